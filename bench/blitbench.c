@@ -0,0 +1,138 @@
+/*
+    blitbench.c: Throughput of the pixel kernels
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <blit.h>
+#include <scrollback.h>
+
+// A 1920x1080 frame, big enough to not live in cache.
+#define PIXELS (1920 * 1080)
+#define ROUNDS 64
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *kernels, const char *op, double seconds) {
+    double bytes = (double)PIXELS * sizeof(uint32_t) * ROUNDS;
+    printf("%s.%s %.2f GB/s\n", kernels, op, bytes / seconds / 1e9);
+}
+
+int main(void) {
+    uint32_t *src = malloc(PIXELS * sizeof(uint32_t));
+    uint32_t *dst = malloc(PIXELS * sizeof(uint32_t));
+    if (src == NULL || dst == NULL) {
+        perror("Could not allocate buffers");
+        return 1;
+    }
+    memset(src, 0x5a, PIXELS * sizeof(uint32_t));
+    memset(dst, 0, PIXELS * sizeof(uint32_t));
+
+    // A frame's worth of bytes of log output, coloured every few lines.
+    char *text = malloc(PIXELS * sizeof(uint32_t));
+    if (text == NULL) {
+        perror("Could not allocate buffers");
+        return 1;
+    }
+    size_t text_len = 0;
+    for (int line = 0; text_len + 128 < PIXELS * sizeof(uint32_t); line++) {
+        text_len += sprintf(text + text_len, "%s%06d connection accepted from 10.0.%d.%d port %d\r\n",
+                            line % 8 == 0 ? "\033[32m" : "\033[0m", line, line % 256, line % 7, line);
+    }
+    while (text_len < PIXELS * sizeof(uint32_t)) {
+        text[text_len++] = ' ';
+    }
+
+    // A 1920x1080 screen of cells, with the default history.
+    struct arena arena = {0};
+    struct scrollback sb;
+    if (!scrollback_init(&sb, &arena, 1000, 1920 / 8, 1080 / 16)) {
+        perror("Could not allocate scrollback");
+        return 1;
+    }
+
+    blit_init();
+    const struct blit_kernels *selected = blit;
+    size_t count;
+    const struct blit_kernels *const *variants = blit_variants(&count);
+    for (size_t i = 0; i < count; i++) {
+        const struct blit_kernels *k = variants[i];
+        double start;
+
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            k->fill(dst, r, PIXELS);
+        }
+        report(k->name, "fill", now() - start);
+
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            k->fill_nt(dst, r, PIXELS);
+        }
+        report(k->name, "fill_nt", now() - start);
+
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            k->copy(dst, src, PIXELS);
+        }
+        report(k->name, "copy", now() - start);
+
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            k->copy_nt(dst, src, PIXELS);
+        }
+        report(k->name, "copy_nt", now() - start);
+
+        // Scroll a frame of 8x16 cells up by a line of text.
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            k->move(dst, dst + 1920 * 16, PIXELS - 1920 * 16);
+        }
+        report(k->name, "move", now() - start);
+
+        // Scan a frame's worth of bytes of text with nothing to stop at.
+        start = now();
+        size_t scanned = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            scanned += k->printable_run((const char *)src, PIXELS * sizeof(uint32_t));
+        }
+        report(k->name, "printable_run", now() - start);
+        if (scanned != (size_t)ROUNDS * PIXELS * sizeof(uint32_t)) {
+            fprintf(stderr, "%s.printable_run stopped early\n", k->name);
+            return 1;
+        }
+
+        // Mirror that log output for scrollback, the per-byte cost that
+        // printable_run keeps down, on top of flanterm's own parsing.
+        blit = k;
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            scrollback_feed(&sb, text, PIXELS * sizeof(uint32_t));
+        }
+        report(k->name, "scrollback_feed", now() - start);
+        blit = selected;
+    }
+
+    printf("selected %s\n", blit->name);
+    return 0;
+}
@@ -0,0 +1,585 @@
+/*
+    gconbench.c: Headless end to end benchmarks of gcon
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdnoreturn.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// gcon is run with a memfd for a framebuffer and a pipe for a keyboard, so
+// everything here works on any Linux machine, and what is measured is what
+// a user would see: bytes in until pixels out.
+
+#define SCANCODE_ALT 0x38
+#define SCANCODE_F1 0x3b
+#define SCANCODE_ENTER 0x1c
+#define SCANCODE_RELEASE 0x80
+
+static unsigned int width = 1024;
+static unsigned int height = 768;
+static unsigned int bpp = 32;
+static size_t stream_size = 16 * 1024 * 1024;
+static int repetitions = 3;
+static int samples = 200;
+static char **gcon_argv;
+static int gcon_argc;
+
+struct run {
+    pid_t pid;
+    int kbd;
+    uint32_t *fb;
+    uint32_t *seen;
+    size_t fb_size;
+    char stats_path[64];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void nap_us(long us) {
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static noreturn void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+static void start_gcon(struct run *run, const char *command, const char *extra) {
+    int fb = memfd_create("gconbench-fb", 0);
+    if (fb == -1) {
+        die("Could not create framebuffer memfd");
+    }
+    // gcon flips between two pages, or scrolls over three, when given the
+    // room.
+    run->fb_size = (size_t)width * height * (bpp / 8) * 3;
+    if (ftruncate(fb, run->fb_size) == -1) {
+        die("Could not size framebuffer memfd");
+    }
+    run->fb = mmap(NULL, run->fb_size, PROT_READ, MAP_SHARED, fb, 0);
+    run->seen = malloc(run->fb_size);
+    if (run->fb == MAP_FAILED || run->seen == NULL) {
+        die("Could not map framebuffer memfd");
+    }
+    memset(run->seen, 0, run->fb_size);
+
+    int kbd[2];
+    if (pipe(kbd) == -1) {
+        die("Could not create keyboard pipe");
+    }
+    strcpy(run->stats_path, "/tmp/gconbench-stats-XXXXXX");
+    int stats = mkstemp(run->stats_path);
+    if (stats == -1) {
+        die("Could not create stats file");
+    }
+    close(stats);
+
+    run->pid = fork();
+    if (run->pid == -1) {
+        die("Could not fork");
+    }
+    if (run->pid == 0) {
+        char fb_path[32], kbd_path[32], geometry[32];
+        snprintf(fb_path, sizeof(fb_path), "/dev/fd/%d", fb);
+        snprintf(kbd_path, sizeof(kbd_path), "/dev/fd/%d", kbd[0]);
+        snprintf(geometry, sizeof(geometry), "%ux%ux%u", width, height, bpp);
+        close(kbd[1]);
+
+        char **argv = malloc((gcon_argc + 32) * sizeof(char *));
+        if (argv == NULL) {
+            _exit(1);
+        }
+        int argc = 0;
+        argv[argc++] = gcon_argv[0];
+        for (int i = 1; i < gcon_argc; i++) {
+            argv[argc++] = gcon_argv[i];
+        }
+        char *fixed[] = {
+            "-f", fb_path, "-g", geometry, "-k", kbd_path, "-b", "/dev/null",
+            "-c", (char *)command, "-x", "-o", run->stats_path
+        };
+        for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+            argv[argc++] = fixed[i];
+        }
+        if (extra != NULL) {
+            argv[argc++] = (char *)extra;
+        }
+        argv[argc] = NULL;
+
+        execv(argv[0], argv);
+        perror("Could not start gcon");
+        _exit(1);
+    }
+
+    close(fb);
+    close(kbd[0]);
+    run->kbd = kbd[1];
+}
+
+static uint64_t read_stat(struct run *run, const char *name) {
+    FILE *file = fopen(run->stats_path, "r");
+    if (file == NULL) {
+        die("Could not read stats");
+    }
+    char key[128];
+    unsigned long long value;
+    uint64_t result = 0;
+    while (fscanf(file, "%127s %llu", key, &value) == 2) {
+        if (strcmp(key, name) == 0) {
+            result = value;
+            break;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+// Wait for gcon to exit, asking it to first if it would not on its own, and
+// keep the page it showed last in shown if not NULL.
+static void stop_gcon(struct run *run, bool terminate, uint8_t *shown) {
+    if (terminate) {
+        kill(run->pid, SIGTERM);
+    }
+    int status;
+    if (waitpid(run->pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "gcon did not exit cleanly\n");
+        exit(1);
+    }
+    if (shown != NULL) {
+        size_t line_size = (size_t)width * (bpp / 8);
+        memcpy(shown, (uint8_t *)run->fb + read_stat(run, "fb.shown_line") * line_size, line_size * height);
+    }
+    close(run->kbd);
+    munmap(run->fb, run->fb_size);
+    free(run->seen);
+}
+
+static void send_keys(struct run *run, const uint8_t *scancodes, size_t count) {
+    if (write(run->kbd, scancodes, count) != (ssize_t)count) {
+        die("Could not write scancodes");
+    }
+}
+
+// Time when the framebuffer next differs from what was seen last, or 0.
+static uint64_t wait_change(struct run *run, uint64_t timeout_ns) {
+    uint64_t deadline = now_ns() + timeout_ns;
+    for (;;) {
+        if (memcmp(run->fb, run->seen, run->fb_size) != 0) {
+            uint64_t when = now_ns();
+            memcpy(run->seen, run->fb, run->fb_size);
+            return when;
+        }
+        if (now_ns() > deadline) {
+            return 0;
+        }
+        nap_us(20);
+    }
+}
+
+// Wait until the framebuffer has not changed for a while.
+static void wait_settled(struct run *run, uint64_t quiet_ns) {
+    uint64_t last_change = now_ns();
+    while (now_ns() - last_change < quiet_ns) {
+        nap_us(1000);
+        if (memcmp(run->fb, run->seen, run->fb_size) != 0) {
+            memcpy(run->seen, run->fb, run->fb_size);
+            last_change = now_ns();
+        }
+    }
+}
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void put_word(FILE *out) {
+    int len = 1 + rng() % 10;
+    for (int i = 0; i < len; i++) {
+        fputc('a' + rng() % 26, out);
+    }
+}
+
+// Lines of words, what compilers and logs print.
+static void gen_plain(FILE *out) {
+    while ((size_t)ftell(out) < stream_size) {
+        int words = rng() % 16;
+        for (int i = 0; i < words; i++) {
+            put_word(out);
+            fputc(' ', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+// The same with every word in a colour of its own, like ls or grep output.
+static void gen_colour(FILE *out) {
+    while ((size_t)ftell(out) < stream_size) {
+        int words = rng() % 16;
+        for (int i = 0; i < words; i++) {
+            fprintf(out, "\e[%u;3%um", rng() % 2, rng() % 8);
+            put_word(out);
+            fputs("\e[0m ", out);
+        }
+        fputc('\n', out);
+    }
+}
+
+// Short updates all over the screen, like a full screen program redrawing.
+static void gen_tui(FILE *out) {
+    unsigned int rows = height / 16, cols = width / 8;
+    for (unsigned int frame = 0; (size_t)ftell(out) < stream_size; frame++) {
+        if (frame % 100 == 0) {
+            fputs("\e[H\e[2J", out);
+        }
+        for (int i = 0; i < 32; i++) {
+            fprintf(out, "\e[%u;%uH\e[7m", 1 + rng() % rows, 1 + rng() % (cols - 12));
+            put_word(out);
+            fputs("\e[0m\e[K", out);
+        }
+        fprintf(out, "\e[%u;1H\e[44m status %u \e[0m", rows, frame);
+    }
+}
+
+static char *make_stream(void (*gen)(FILE *), size_t *size) {
+    static char path[64];
+    strcpy(path, "/tmp/gconbench-stream-XXXXXX");
+    int fd = mkstemp(path);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (out == NULL) {
+        die("Could not create stream");
+    }
+    gen(out);
+    *size = ftell(out);
+    fclose(out);
+    return path;
+}
+
+// Seconds it takes gcon to draw a command's output and exit, best of a few.
+static double time_command(const char *command) {
+    double best = 0;
+    for (int i = 0; i < repetitions; i++) {
+        struct run run;
+        uint64_t start = now_ns();
+        start_gcon(&run, command, NULL);
+        stop_gcon(&run, false, NULL);
+        double elapsed = (now_ns() - start) / 1e9;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        unlink(run.stats_path);
+    }
+    return best;
+}
+
+// Milliseconds from gcon starting to it showing the first thing a session
+// printed, by its own account, best of a few.
+static double first_output(void) {
+    double best = 0;
+    for (int i = 0; i < repetitions; i++) {
+        struct run run;
+        start_gcon(&run, "echo ready", NULL);
+        stop_gcon(&run, false, NULL);
+        double elapsed = read_stat(&run, "startup.first_output_ns") / 1e6;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        unlink(run.stats_path);
+    }
+    return best;
+}
+
+static double throughput(void (*gen)(FILE *), double baseline) {
+    size_t size;
+    char *path = make_stream(gen, &size);
+    char command[128];
+    snprintf(command, sizeof(command), "exec cat %s", path);
+    double elapsed = time_command(command) - baseline;
+    unlink(path);
+    return elapsed > 0 ? size / elapsed / 1e6 : 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *values, size_t count, unsigned int pct) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(values, count, sizeof(uint64_t), compare_u64);
+    return values[(count - 1) * pct / 100] / 1e3;
+}
+
+static void switch_to(struct run *run, int tty) {
+    uint8_t press[4] = {
+        SCANCODE_ALT, SCANCODE_F1 + tty,
+        (SCANCODE_F1 + tty) | SCANCODE_RELEASE, SCANCODE_ALT | SCANCODE_RELEASE
+    };
+    send_keys(run, press, 4);
+}
+
+// Time from a key press to its echo showing up, with cat on the other end,
+// optionally while another tty floods output in the background.
+static void echo_latency(const char *extra, bool flood, double *p50, double *p99) {
+    static const uint8_t keys[] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19};
+    uint64_t *latencies = calloc(samples, sizeof(uint64_t));
+    if (latencies == NULL) {
+        die("Could not allocate samples");
+    }
+
+    struct run run;
+    start_gcon(&run, "if [ \"$GCON_TTY\" = 0 ]; then exec cat; else exec yes; fi", extra);
+    wait_change(&run, 2000000000);
+    wait_settled(&run, 100000000);
+    if (flood) {
+        switch_to(&run, 1);
+        nap_us(200000);
+        switch_to(&run, 0);
+        wait_settled(&run, 100000000);
+    }
+
+    size_t count = 0;
+    for (int i = 0; i < samples; i++) {
+        uint8_t press[2] = {keys[i % sizeof(keys)], keys[i % sizeof(keys)] | SCANCODE_RELEASE};
+        uint64_t start = now_ns();
+        send_keys(&run, press, 2);
+        uint64_t shown = wait_change(&run, 1000000000);
+        if (shown != 0) {
+            latencies[count++] = shown - start;
+        }
+        wait_settled(&run, 30000000);
+
+        // Keep lines short, the line buffers are finite.
+        if (i % 32 == 31) {
+            uint8_t enter[2] = {SCANCODE_ENTER, SCANCODE_ENTER | SCANCODE_RELEASE};
+            send_keys(&run, enter, 2);
+            wait_settled(&run, 30000000);
+        }
+    }
+    stop_gcon(&run, true, NULL);
+    unlink(run.stats_path);
+
+    *p50 = percentile_us(latencies, count, 50);
+    *p99 = percentile_us(latencies, count, 99);
+    free(latencies);
+}
+
+struct switch_result {
+    double mean_us;
+    double max_us;
+    double visible_p50_us;
+    double visible_p99_us;
+};
+
+// Bounce between the first tty and the others, timing both gcon's own
+// account of each switch and how long it took to show up.
+static void switch_time(struct switch_result *result) {
+    uint64_t *latencies = calloc(samples, sizeof(uint64_t));
+    if (latencies == NULL) {
+        die("Could not allocate samples");
+    }
+
+    struct run run;
+    start_gcon(&run, "tty; exec sleep 3600", NULL);
+    wait_change(&run, 2000000000);
+    wait_settled(&run, 100000000);
+
+    size_t count = 0;
+    for (int i = 0; i < samples; i++) {
+        int target = i % 2 == 0 ? 1 + (i / 2) % 7 : 0;
+        uint64_t start = now_ns();
+        switch_to(&run, target);
+        uint64_t shown = wait_change(&run, 1000000000);
+        if (shown != 0) {
+            latencies[count++] = shown - start;
+        }
+        wait_settled(&run, 30000000);
+    }
+    stop_gcon(&run, true, NULL);
+
+    uint64_t switches = read_stat(&run, "switch.count");
+    result->mean_us = switches ? read_stat(&run, "switch.total_ns") / 1e3 / switches : 0;
+    result->max_us = read_stat(&run, "switch.max_ns") / 1e3;
+    result->visible_p50_us = percentile_us(latencies, count, 50);
+    result->visible_p99_us = percentile_us(latencies, count, 99);
+    unlink(run.stats_path);
+    free(latencies);
+}
+
+// Draw the same screen with gcon given baseline and given flag, the page
+// shown last has to be the same, and the stat that counts what the flag
+// does has to be non zero.
+static bool same_screen(const char *command, const char *baseline, const char *flag, const char *stat) {
+    size_t page_size = (size_t)width * height * (bpp / 8);
+    uint8_t *single = malloc(page_size);
+    uint8_t *other = malloc(page_size);
+    if (single == NULL || other == NULL) {
+        die("Could not allocate pages");
+    }
+
+    struct run run;
+    start_gcon(&run, command, baseline);
+    stop_gcon(&run, false, single);
+    unlink(run.stats_path);
+
+    start_gcon(&run, command, flag);
+    stop_gcon(&run, false, other);
+    bool ok = read_stat(&run, stat) != 0 && memcmp(single, other, page_size) == 0;
+    unlink(run.stats_path);
+
+    free(single);
+    free(other);
+    return ok;
+}
+
+// Compare a way of presenting with drawing to a single page. The screen is
+// drawn over a few frames that scroll and then change other rows, so that
+// lines missed by either show.
+static bool present_mode_ok(const char *flag, const char *stat) {
+    const char *command =
+        "i=0; while [ $i -lt 100 ]; do printf '\\033[3%dmline %d\\n' $((i % 8)) $i; i=$((i + 1)); "
+        "if [ $((i % 10)) = 0 ]; then sleep 0.05; fi; done; "
+        "sleep 0.2; printf '\\033[5;1Hfirst'; sleep 0.2; printf '\\033[20;1Hsecond'; sleep 0.2";
+    return same_screen(command, "-s", flag, stat);
+}
+
+// Compare jump scrolling with drawing every line, over a flood of coloured
+// plain text with some cursor movement in the middle and at the end.
+static bool jump_scroll_ok(void) {
+    const char *command =
+        "printf '\\033[32;44m'; seq 1 100000; printf '\\033[3;5Hmoved\\033[0m\\n'; "
+        "seq 1 50000 | sed 's/$/ line/'; printf '\\033[2Aup'";
+    return same_screen(command, "-j", NULL, "jump.count");
+}
+
+static noreturn void usage(const char *name, int status) {
+    fprintf(status ? stderr : stdout,
+        "Usage: %s [-g WxH] [-s MiB] [-n reps] [-S samples] [-o file] gcon [gcon options]\n"
+        "  -g WxH[xBPP]\n"
+        "             Framebuffer size and depth (default 1024x768x32)\n"
+        "  -s MiB     Size of each throughput stream (default 16)\n"
+        "  -n reps    Runs per throughput stream, the best one counts (default 3)\n"
+        "  -S count   Samples for echo and switch latencies (default 200)\n"
+        "  -o file    Write results as JSON to file\n",
+        name);
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "+g:s:n:S:o:h")) != -1) {
+        switch (opt) {
+            case 'g':
+                if (sscanf(optarg, "%ux%ux%u", &width, &height, &bpp) < 2 || width < 160 || height < 64 ||
+                    (bpp != 16 && bpp != 24 && bpp != 32)) {
+                    usage(argv[0], 1);
+                }
+                break;
+            case 's': stream_size = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'n': repetitions = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'S': samples = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'o': output = optarg; break;
+            case 'h': usage(argv[0], 0);
+            default:  usage(argv[0], 1);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0], 1);
+    }
+    gcon_argv = argv + optind;
+    gcon_argc = argc - optind;
+
+    double baseline = time_command("true");
+    double first_output_ms = first_output();
+    double plain = throughput(gen_plain, baseline);
+    double colour = throughput(gen_colour, baseline);
+    double tui = throughput(gen_tui, baseline);
+    struct switch_result sw;
+    switch_time(&sw);
+    double cooked_p50, cooked_p99, passthrough_p50, passthrough_p99, flood_p50, flood_p99;
+    echo_latency(NULL, false, &cooked_p50, &cooked_p99);
+    echo_latency("-p0", false, &passthrough_p50, &passthrough_p99);
+    echo_latency(NULL, true, &flood_p50, &flood_p99);
+    bool flip_ok = present_mode_ok(NULL, "fb.flips");
+    bool scroll_ok = present_mode_ok("-y", "fb.scrolls");
+    bool jump_ok = jump_scroll_ok();
+
+    FILE *out = output != NULL ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        die("Could not write results");
+    }
+    fprintf(out,
+        "{\n"
+        "  \"geometry\": \"%ux%ux%u\",\n"
+        "  \"startup_ms\": %.3f,\n"
+        "  \"first_output_ms\": %.3f,\n"
+        "  \"plain_mb_s\": %.2f,\n"
+        "  \"colour_mb_s\": %.2f,\n"
+        "  \"tui_mb_s\": %.2f,\n"
+        "  \"switch_mean_us\": %.1f,\n"
+        "  \"switch_max_us\": %.1f,\n"
+        "  \"switch_visible_p50_us\": %.1f,\n"
+        "  \"switch_visible_p99_us\": %.1f,\n"
+        "  \"echo_cooked_p50_us\": %.1f,\n"
+        "  \"echo_cooked_p99_us\": %.1f,\n"
+        "  \"echo_passthrough_p50_us\": %.1f,\n"
+        "  \"echo_passthrough_p99_us\": %.1f,\n"
+        "  \"echo_flood_p50_us\": %.1f,\n"
+        "  \"echo_flood_p99_us\": %.1f,\n"
+        "  \"page_flip_ok\": %s,\n"
+        "  \"pan_scroll_ok\": %s,\n"
+        "  \"jump_scroll_ok\": %s\n"
+        "}\n",
+        width, height, bpp, baseline * 1e3, first_output_ms, plain, colour, tui,
+        sw.mean_us, sw.max_us, sw.visible_p50_us, sw.visible_p99_us,
+        cooked_p50, cooked_p99, passthrough_p50, passthrough_p99, flood_p50, flood_p99,
+        flip_ok ? "true" : "false", scroll_ok ? "true" : "false", jump_ok ? "true" : "false");
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (!flip_ok || !scroll_ok) {
+        fprintf(stderr, "What was shown %s differs from drawing to a single page\n",
+            flip_ok ? "scrolling by panning" : "with page flipping");
+        return 1;
+    }
+    if (!jump_ok) {
+        fprintf(stderr, "What was shown jump scrolling differs from drawing every line\n");
+        return 1;
+    }
+    return 0;
+}
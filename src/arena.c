@@ -0,0 +1,117 @@
+/*
+    arena.c: Per terminal memory arenas
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <arena.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define CHUNK_SIZE (1024 * 1024)
+#define ALIGNMENT alignof(max_align_t)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    size_t last;
+};
+
+static struct arena *selected;
+
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size) {
+    size_t header = align_up(sizeof(struct arena_chunk), ALIGNMENT);
+    size_t map_size = align_up(header + size, CHUNK_SIZE);
+    struct arena_chunk *chunk = mmap(
+        NULL,
+        map_size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (chunk == MAP_FAILED) {
+        return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->size = map_size;
+    chunk->used = header;
+    chunk->last = header;
+    arena->chunks = chunk;
+    arena->reserved += map_size;
+    return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = align_up(size, ALIGNMENT);
+
+    struct arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk = new_chunk(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    chunk->last = chunk->used;
+    chunk->used += size;
+    arena->held += size;
+    return (uint8_t *)chunk + chunk->last;
+}
+
+void arena_free(struct arena *arena, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    size = align_up(size, ALIGNMENT);
+    arena->held -= size;
+
+    struct arena_chunk *chunk = arena->chunks;
+    if (chunk != NULL && (uint8_t *)chunk + chunk->last == ptr && chunk->last + size == chunk->used) {
+        chunk->used = chunk->last;
+    }
+}
+
+void arena_release(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+    arena->held = 0;
+    arena->reserved = 0;
+}
+
+void arena_select(struct arena *arena) {
+    selected = arena;
+}
+
+void *arena_selected_alloc(size_t size) {
+    return arena_alloc(selected, size);
+}
+
+void arena_selected_free(void *ptr, size_t size) {
+    arena_free(selected, ptr, size);
+}
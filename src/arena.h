@@ -0,0 +1,50 @@
+/*
+    arena.h: Per terminal memory arenas
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+// Bump allocator over large mappings, so that everything a terminal owns
+// sits together and can be dropped at once. A zeroed arena is empty.
+struct arena {
+    struct arena_chunk *chunks;
+    size_t held;
+    size_t reserved;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+
+// Return memory to the arena. Only the most recent allocation is actually
+// reused, the rest is just accounted for until the arena is released.
+void arena_free(struct arena *arena, void *ptr, size_t size);
+
+// Unmap everything the arena holds, leaving it empty.
+void arena_release(struct arena *arena);
+
+// flanterm takes allocation callbacks without a user pointer, so these go
+// to whichever arena was selected last. Callers serialize selection with
+// the calls that end up allocating.
+void arena_select(struct arena *arena);
+void *arena_selected_alloc(size_t size);
+void arena_selected_free(void *ptr, size_t size);
+
+#endif
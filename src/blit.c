@@ -0,0 +1,235 @@
+/*
+    blit.c: Pixel fill, copy and move kernels
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <blit.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86 1
+#endif
+
+static void scalar_fill(uint32_t *dst, uint32_t value, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = value;
+    }
+}
+
+static void scalar_copy(uint32_t *dst, const uint32_t *src, size_t count) {
+    memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static void scalar_move(uint32_t *dst, const uint32_t *src, size_t count) {
+    memmove(dst, src, count * sizeof(uint32_t));
+}
+
+static size_t scalar_printable_run(const char *buf, size_t len) {
+    size_t i = 0;
+    while (i < len && buf[i] >= 0x20 && buf[i] < 0x7f) {
+        i++;
+    }
+    return i;
+}
+
+static const struct blit_kernels scalar_kernels = {
+    .name          = "scalar",
+    .fill          = scalar_fill,
+    .fill_nt       = scalar_fill,
+    .copy          = scalar_copy,
+    .copy_nt       = scalar_copy,
+    .move          = scalar_move,
+    .printable_run = scalar_printable_run
+};
+
+#ifdef BLIT_X86
+
+// Aligned stores need 16 or 32 byte alignment, so kernels do a scalar head
+// of this many pixels until dst is aligned, the vector body, and a tail.
+static size_t align_head(const uint32_t *dst, size_t count, size_t align) {
+    size_t head = ((align - ((uintptr_t)dst & (align - 1))) & (align - 1)) / sizeof(uint32_t);
+    return head < count ? head : count;
+}
+
+#define DEFINE_FILL(prefix, isa, vec, width, set1, store) \
+    __attribute__((target(isa))) \
+    static void prefix(uint32_t *dst, uint32_t value, size_t count) { \
+        size_t head = align_head(dst, count, width * sizeof(uint32_t)); \
+        scalar_fill(dst, value, head); \
+        dst += head; \
+        count -= head; \
+        vec v = set1((int)value); \
+        size_t i = 0; \
+        for (; i + width <= count; i += width) { \
+            store((vec *)(dst + i), v); \
+        } \
+        scalar_fill(dst + i, value, count - i); \
+    }
+
+#define DEFINE_COPY(prefix, isa, vec, width, load, store) \
+    __attribute__((target(isa))) \
+    static void prefix(uint32_t *dst, const uint32_t *src, size_t count) { \
+        size_t head = align_head(dst, count, width * sizeof(uint32_t)); \
+        for (size_t i = 0; i < head; i++) { \
+            dst[i] = src[i]; \
+        } \
+        dst += head; \
+        src += head; \
+        count -= head; \
+        size_t i = 0; \
+        for (; i + 4 * width <= count; i += 4 * width) { \
+            vec a = load((const vec *)(src + i)); \
+            vec b = load((const vec *)(src + i + width)); \
+            vec c = load((const vec *)(src + i + 2 * width)); \
+            vec d = load((const vec *)(src + i + 3 * width)); \
+            store((vec *)(dst + i), a); \
+            store((vec *)(dst + i + width), b); \
+            store((vec *)(dst + i + 2 * width), c); \
+            store((vec *)(dst + i + 3 * width), d); \
+        } \
+        for (; i + width <= count; i += width) { \
+            store((vec *)(dst + i), load((const vec *)(src + i))); \
+        } \
+        for (; i < count; i++) { \
+            dst[i] = src[i]; \
+        } \
+    }
+
+// Overlapping moves, for scrolling. Going forward is safe when dst is below
+// src since every vector is loaded before the store that could clobber it,
+// otherwise go backwards.
+#define DEFINE_MOVE(prefix, isa, vec, width, load, storeu) \
+    __attribute__((target(isa))) \
+    static void prefix(uint32_t *dst, const uint32_t *src, size_t count) { \
+        if (dst == src) { \
+            return; \
+        } \
+        size_t i = 0; \
+        if (dst < src) { \
+            for (; i + width <= count; i += width) { \
+                storeu((vec *)(dst + i), load((const vec *)(src + i))); \
+            } \
+            for (; i < count; i++) { \
+                dst[i] = src[i]; \
+            } \
+        } else { \
+            i = count; \
+            for (; i >= width; i -= width) { \
+                storeu((vec *)(dst + i - width), load((const vec *)(src + i - width))); \
+            } \
+            while (i-- > 0) { \
+                dst[i] = src[i]; \
+            } \
+        } \
+    }
+
+// Bytes are compared signed, so everything from 0x80 up is below 0x20 too
+// and a single pair of comparisons finds anything that is not printable.
+#define DEFINE_PRINTABLE_RUN(prefix, isa, vec, width, loadu, set1, cmpgt, and, movemask) \
+    __attribute__((target(isa))) \
+    static size_t prefix(const char *buf, size_t len) { \
+        const vec low = set1(0x1f); \
+        const vec high = set1(0x7f); \
+        size_t i = 0; \
+        for (; i + width <= len; i += width) { \
+            vec v = loadu((const vec *)(buf + i)); \
+            uint32_t mask = movemask(and(cmpgt(v, low), cmpgt(high, v))); \
+            if (mask != (uint32_t)((1ull << width) - 1)) { \
+                return i + __builtin_ctz(~mask); \
+            } \
+        } \
+        return i + scalar_printable_run(buf + i, len - i); \
+    }
+
+DEFINE_FILL(sse2_fill, "sse2", __m128i, 4, _mm_set1_epi32, _mm_store_si128)
+DEFINE_FILL(sse2_fill_nt_body, "sse2", __m128i, 4, _mm_set1_epi32, _mm_stream_si128)
+DEFINE_COPY(sse2_copy, "sse2", __m128i, 4, _mm_loadu_si128, _mm_store_si128)
+DEFINE_COPY(sse2_copy_nt_body, "sse2", __m128i, 4, _mm_loadu_si128, _mm_stream_si128)
+DEFINE_MOVE(sse2_move, "sse2", __m128i, 4, _mm_loadu_si128, _mm_storeu_si128)
+DEFINE_PRINTABLE_RUN(sse2_printable_run, "sse2", __m128i, 16, _mm_loadu_si128,
+                     _mm_set1_epi8, _mm_cmpgt_epi8, _mm_and_si128, _mm_movemask_epi8)
+
+DEFINE_FILL(avx2_fill, "avx2", __m256i, 8, _mm256_set1_epi32, _mm256_store_si256)
+DEFINE_FILL(avx2_fill_nt_body, "avx2", __m256i, 8, _mm256_set1_epi32, _mm256_stream_si256)
+DEFINE_COPY(avx2_copy, "avx2", __m256i, 8, _mm256_loadu_si256, _mm256_store_si256)
+DEFINE_COPY(avx2_copy_nt_body, "avx2", __m256i, 8, _mm256_loadu_si256, _mm256_stream_si256)
+DEFINE_MOVE(avx2_move, "avx2", __m256i, 8, _mm256_loadu_si256, _mm256_storeu_si256)
+DEFINE_PRINTABLE_RUN(avx2_printable_run, "avx2", __m256i, 32, _mm256_loadu_si256,
+                     _mm256_set1_epi8, _mm256_cmpgt_epi8, _mm256_and_si256, _mm256_movemask_epi8)
+
+// Streaming stores are weakly ordered, fence them so callers can treat the
+// kernels like any other store.
+#define DEFINE_FENCED(prefix, body, ...) \
+    __attribute__((target("sse2"))) \
+    static void prefix(uint32_t *dst, __VA_ARGS__, size_t count) { \
+        body; \
+        _mm_sfence(); \
+    }
+
+DEFINE_FENCED(sse2_fill_nt, sse2_fill_nt_body(dst, value, count), uint32_t value)
+DEFINE_FENCED(sse2_copy_nt, sse2_copy_nt_body(dst, src, count), const uint32_t *src)
+DEFINE_FENCED(avx2_fill_nt, avx2_fill_nt_body(dst, value, count), uint32_t value)
+DEFINE_FENCED(avx2_copy_nt, avx2_copy_nt_body(dst, src, count), const uint32_t *src)
+
+static const struct blit_kernels sse2_kernels = {
+    .name          = "sse2",
+    .fill          = sse2_fill,
+    .fill_nt       = sse2_fill_nt,
+    .copy          = sse2_copy,
+    .copy_nt       = sse2_copy_nt,
+    .move          = sse2_move,
+    .printable_run = sse2_printable_run
+};
+
+static const struct blit_kernels avx2_kernels = {
+    .name          = "avx2",
+    .fill          = avx2_fill,
+    .fill_nt       = avx2_fill_nt,
+    .copy          = avx2_copy,
+    .copy_nt       = avx2_copy_nt,
+    .move          = avx2_move,
+    .printable_run = avx2_printable_run
+};
+
+#endif
+
+static const struct blit_kernels *variants[3];
+static size_t variant_count = 0;
+
+const struct blit_kernels *blit = &scalar_kernels;
+
+void blit_init(void) {
+    variant_count = 0;
+    variants[variant_count++] = &scalar_kernels;
+
+#ifdef BLIT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        variants[variant_count++] = &sse2_kernels;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        variants[variant_count++] = &avx2_kernels;
+    }
+#endif
+
+    blit = variants[variant_count - 1];
+}
+
+const struct blit_kernels *const *blit_variants(size_t *count) {
+    *count = variant_count;
+    return variants;
+}
@@ -0,0 +1,50 @@
+/*
+    blit.h: Pixel fill, copy and move kernels
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// All counts are in 32 bit pixels. The _nt variants are meant for writing
+// device memory, they bypass the cache where the CPU allows it and are
+// ordered before returning.
+struct blit_kernels {
+    const char *name;
+    void (*fill)(uint32_t *dst, uint32_t value, size_t count);
+    void (*fill_nt)(uint32_t *dst, uint32_t value, size_t count);
+    void (*copy)(uint32_t *dst, const uint32_t *src, size_t count);
+    void (*copy_nt)(uint32_t *dst, const uint32_t *src, size_t count);
+    void (*move)(uint32_t *dst, const uint32_t *src, size_t count);
+
+    // Length in bytes of the run of printable ASCII, 0x20 to 0x7e, that buf
+    // starts with, which the scrollback mirror stores without parsing.
+    // flanterm still parses every byte itself.
+    size_t (*printable_run)(const char *buf, size_t len);
+};
+
+// Kernels for the running CPU, valid after blit_init().
+extern const struct blit_kernels *blit;
+
+void blit_init(void);
+
+// Every variant the running CPU supports, best last, for benchmarking.
+const struct blit_kernels *const *blit_variants(size_t *count);
+
+#endif
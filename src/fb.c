@@ -0,0 +1,464 @@
+/*
+    fb.c: Shadow framebuffer and presentation to the device
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fb.h>
+#include <blit.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The device mapping is usually uncached or write-combined, so we never read
+// it back and only write it in sequential runs. Contexts render to a shadow
+// instead, either the shared one or one of their own, and the front buffer
+// holds what the device was last given, which lets us find what changed by
+// comparing plain RAM.
+static uint8_t *device;
+static size_t device_pitch;
+static struct fb_format device_format;
+static size_t device_bpp;
+static uint32_t *shadow;
+static uint32_t *front;
+static size_t fb_width;
+static size_t fb_height;
+
+// Frames go to the fb_height device lines starting at shown_line, the ones
+// being scanned out, unless the device is panned over more of them.
+enum present_mode {
+    PRESENT_SINGLE,
+    PRESENT_FLIP,
+    PRESENT_SCROLL
+};
+
+struct span {
+    size_t first;
+    size_t last;
+};
+
+static enum present_mode mode = PRESENT_SINGLE;
+static size_t shown_line = 0;
+static bool (*pan_to)(size_t yoffset);
+
+// With page flipping, each frame goes to the page not being shown. Rows
+// track the span that changed in the last frame, and the span that the
+// hidden page lags behind the shown one by, which it catches up on when it
+// is next written.
+static struct span *changed;
+static struct span *stale;
+
+// With scrolling, the virtual lines are a ring the shown window moves down
+// along as text scrolls, and only the lines it exposes are drawn. Scrolls
+// are found by matching hashes of the new rows against those of the front
+// buffer, shifted by whole text lines. Front hashes of 0 are yet to be
+// computed.
+static size_t virtual_height;
+static size_t scroll_step;
+static uint64_t *front_hashes;
+static uint64_t *src_hashes;
+
+static uint64_t rows_presented;
+static uint64_t bytes_presented;
+static uint64_t flips;
+static uint64_t scrolls;
+static uint64_t scrolled_lines;
+static uint64_t rebases;
+
+// Writes count shadow pixels to the device at dst, in the device format.
+static void (*write_span)(uint8_t *dst, const uint32_t *src, size_t count);
+
+static void write_xrgb8888(uint8_t *dst, const uint32_t *src, size_t count) {
+    blit->copy_nt((uint32_t *)dst, src, count);
+}
+
+static uint16_t to_rgb565(uint32_t pixel) {
+    return ((pixel >> 8) & 0xf800) | ((pixel >> 5) & 0x07e0) | ((pixel >> 3) & 0x001f);
+}
+
+// Device memory is written in aligned 32 bit stores, packing two pixels in
+// each, so a row costs half the bus traffic of the 32 bit path.
+static void write_rgb565(uint8_t *dst, const uint32_t *src, size_t count) {
+    if (((uintptr_t)dst & 3) && count > 0) {
+        *(uint16_t *)dst = to_rgb565(*src++);
+        dst += 2;
+        count--;
+    }
+    uint32_t *words = (uint32_t *)dst;
+    for (; count >= 2; count -= 2, src += 2) {
+        *words++ = to_rgb565(src[0]) | (uint32_t)to_rgb565(src[1]) << 16;
+    }
+    if (count > 0) {
+        *(uint16_t *)words = to_rgb565(*src);
+    }
+}
+
+static void write_bgr_byte(uint8_t *dst, uint32_t pixel) {
+    uint8_t *bytes = dst;
+    bytes[0] = pixel;
+    bytes[1] = pixel >> 8;
+    bytes[2] = pixel >> 16;
+}
+
+// Pixels are 3 bytes, every 4 of them fill 3 aligned 32 bit stores.
+static void write_rgb888(uint8_t *dst, const uint32_t *src, size_t count) {
+    while (((uintptr_t)dst & 3) && count > 0) {
+        write_bgr_byte(dst, *src++);
+        dst += 3;
+        count--;
+    }
+    uint32_t *words = (uint32_t *)dst;
+    for (; count >= 4; count -= 4, src += 4) {
+        uint32_t a = src[0] & 0xffffff;
+        uint32_t b = src[1] & 0xffffff;
+        uint32_t c = src[2] & 0xffffff;
+        uint32_t d = src[3] & 0xffffff;
+        *words++ = a | b << 24;
+        *words++ = b >> 8 | c << 16;
+        *words++ = c >> 16 | d << 8;
+    }
+    dst = (uint8_t *)words;
+    for (; count > 0; count--, dst += 3) {
+        write_bgr_byte(dst, *src++);
+    }
+}
+
+static uint32_t scale_channel(uint32_t pixel, unsigned int shift, unsigned int offset,
+                              unsigned int length) {
+    return (((pixel >> shift) & 0xff) >> (8 - length)) << offset;
+}
+
+// Any other layout, a pixel at a time.
+static void write_generic(uint8_t *dst, const uint32_t *src, size_t count) {
+    const struct fb_format *f = &device_format;
+    for (size_t i = 0; i < count; i++, dst += device_bpp) {
+        uint32_t value = scale_channel(src[i], 16, f->red_offset, f->red_length)
+                       | scale_channel(src[i], 8, f->green_offset, f->green_length)
+                       | scale_channel(src[i], 0, f->blue_offset, f->blue_length);
+        uint8_t *bytes = dst;
+        for (size_t b = 0; b < device_bpp; b++) {
+            bytes[b] = value >> (b * 8);
+        }
+    }
+}
+
+static bool format_is(const struct fb_format *f, unsigned int bpp,
+                      unsigned int red_offset, unsigned int red_length,
+                      unsigned int green_offset, unsigned int green_length,
+                      unsigned int blue_offset, unsigned int blue_length) {
+    return f->bits_per_pixel == bpp
+        && f->red_offset == red_offset && f->red_length == red_length
+        && f->green_offset == green_offset && f->green_length == green_length
+        && f->blue_offset == blue_offset && f->blue_length == blue_length;
+}
+
+bool fb_format_supported(const struct fb_format *f) {
+    if (f->bits_per_pixel != 16 && f->bits_per_pixel != 24 && f->bits_per_pixel != 32) {
+        return false;
+    }
+    return f->red_length >= 1 && f->red_length <= 8 && f->red_offset + f->red_length <= f->bits_per_pixel
+        && f->green_length >= 1 && f->green_length <= 8 && f->green_offset + f->green_length <= f->bits_per_pixel
+        && f->blue_length >= 1 && f->blue_length <= 8 && f->blue_offset + f->blue_length <= f->bits_per_pixel;
+}
+
+uint32_t *fb_init(void *dev, size_t width, size_t height, size_t dev_pitch,
+                  const struct fb_format *format) {
+    size_t size = width * height * sizeof(uint32_t);
+    shadow = calloc(1, size);
+    front  = calloc(1, size);
+    if (shadow == NULL || front == NULL) {
+        free(shadow);
+        free(front);
+        return NULL;
+    }
+
+    device        = dev;
+    device_pitch  = dev_pitch;
+    device_format = *format;
+    device_bpp    = format->bits_per_pixel / 8;
+    fb_width      = width;
+    fb_height     = height;
+
+    if (format_is(format, 32, 16, 8, 8, 8, 0, 8)) {
+        write_span = write_xrgb8888;
+    } else if (format_is(format, 16, 11, 5, 5, 6, 0, 5)) {
+        write_span = write_rgb565;
+    } else if (format_is(format, 24, 16, 8, 8, 8, 0, 8)) {
+        write_span = write_rgb888;
+    } else {
+        write_span = write_generic;
+    }
+
+    // Match the device to the zeroed front buffer.
+    for (size_t y = 0; y < height; y++) {
+        write_span(device + y * device_pitch, front, width);
+    }
+    return shadow;
+}
+
+static uint8_t *line_base(size_t line) {
+    return device + line * device_pitch;
+}
+
+bool fb_enable_flipping(bool (*pan)(size_t yoffset)) {
+    changed = calloc(fb_height, sizeof(struct span));
+    stale   = calloc(fb_height, sizeof(struct span));
+    if (changed == NULL || stale == NULL) {
+        free(changed);
+        free(stale);
+        return false;
+    }
+
+    // Start the second page out the same as the first.
+    uint8_t *page = line_base(fb_height);
+    for (size_t y = 0; y < fb_height; y++) {
+        write_span(page + y * device_pitch, front + y * fb_width, fb_width);
+    }
+    pan_to = pan;
+    mode = PRESENT_FLIP;
+    shown_line = 0;
+    return true;
+}
+
+bool fb_enable_scrolling(bool (*pan)(size_t yoffset), size_t lines, size_t step) {
+    front_hashes = calloc(fb_height, sizeof(uint64_t));
+    src_hashes   = calloc(fb_height, sizeof(uint64_t));
+    if (front_hashes == NULL || src_hashes == NULL) {
+        free(front_hashes);
+        free(src_hashes);
+        return false;
+    }
+
+    pan_to = pan;
+    mode = PRESENT_SCROLL;
+    shown_line = 0;
+    virtual_height = lines;
+    scroll_step = step;
+    return true;
+}
+
+// Narrow a row down to the span that differs from what was presented, if
+// any, and update the front buffer with it.
+static bool diff_row(const uint32_t *new, uint32_t *old, struct span *span) {
+    if (memcmp(new, old, fb_width * sizeof(uint32_t)) == 0) {
+        span->first = span->last = 0;
+        return false;
+    }
+    span->first = 0;
+    span->last  = fb_width;
+    while (new[span->first] == old[span->first]) {
+        span->first++;
+    }
+    while (new[span->last - 1] == old[span->last - 1]) {
+        span->last--;
+    }
+    blit->copy(old + span->first, new + span->first, span->last - span->first);
+    return true;
+}
+
+static void write_row_span(uint8_t *page, size_t y, struct span span) {
+    uint8_t *dst = page + y * device_pitch + span.first * device_bpp;
+    write_span(dst, front + y * fb_width + span.first, span.last - span.first);
+    rows_presented++;
+    bytes_presented += (span.last - span.first) * device_bpp;
+}
+
+// Copy all of src to the front buffer and the device, from line on.
+static void present_whole(const uint32_t *src, size_t line) {
+    blit->copy(front, src, fb_width * fb_height);
+    for (size_t y = 0; y < fb_height; y++) {
+        write_row_span(line_base(line), y, (struct span){ 0, fb_width });
+    }
+}
+
+static void present_single(const uint32_t *src) {
+    uint8_t *page = line_base(shown_line);
+    for (size_t y = 0; y < fb_height; y++) {
+        struct span span;
+        if (diff_row(src + y * fb_width, front + y * fb_width, &span)) {
+            write_row_span(page, y, span);
+        }
+    }
+}
+
+static void present_flipped(const uint32_t *src) {
+    bool any = false;
+    for (size_t y = 0; y < fb_height; y++) {
+        any |= diff_row(src + y * fb_width, front + y * fb_width, &changed[y]);
+    }
+    if (!any) {
+        return;
+    }
+
+    size_t back = shown_line == 0 ? fb_height : 0;
+    for (size_t y = 0; y < fb_height; y++) {
+        struct span span = changed[y];
+        if (stale[y].first < stale[y].last) {
+            if (span.first == span.last) {
+                span = stale[y];
+            } else {
+                span.first = stale[y].first < span.first ? stale[y].first : span.first;
+                span.last  = stale[y].last > span.last ? stale[y].last : span.last;
+            }
+        }
+        if (span.first < span.last) {
+            write_row_span(line_base(back), y, span);
+        }
+        stale[y] = changed[y];
+    }
+
+    if (pan_to(back)) {
+        shown_line = back;
+        flips++;
+        return;
+    }
+
+    // Panning does not work after all, bring the shown page up to date and
+    // keep to it.
+    mode = PRESENT_SINGLE;
+    for (size_t y = 0; y < fb_height; y++) {
+        if (changed[y].first < changed[y].last) {
+            write_row_span(line_base(shown_line), y, changed[y]);
+        }
+    }
+}
+
+static uint64_t hash_row(const uint32_t *row) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t x = 0; x < fb_width; x++) {
+        hash = (hash ^ row[x]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Lines src is the front buffer scrolled up by, or 0 if it does not look
+// scrolled. Scrolling has to leave more rows in place than not scrolling
+// does, by at least a text line, to be worth it.
+static size_t find_scroll(const uint32_t *src, size_t unchanged) {
+    for (size_t y = 0; y < fb_height; y++) {
+        src_hashes[y] = hash_row(src + y * fb_width);
+        if (front_hashes[y] == 0) {
+            front_hashes[y] = hash_row(front + y * fb_width);
+        }
+    }
+
+    size_t best = 0;
+    size_t best_matches = unchanged + scroll_step - 1;
+    for (size_t lines = scroll_step; lines < fb_height; lines += scroll_step) {
+        size_t matches = 0;
+        for (size_t y = 0; y + lines < fb_height; y++) {
+            matches += src_hashes[y] == front_hashes[y + lines];
+        }
+        if (matches > best_matches) {
+            best = lines;
+            best_matches = matches;
+        }
+    }
+    return best;
+}
+
+static void present_scrolled(const uint32_t *src) {
+    size_t unchanged = 0;
+    for (size_t y = 0; y < fb_height; y++) {
+        unchanged += memcmp(src + y * fb_width, front + y * fb_width, fb_width * sizeof(uint32_t)) == 0;
+    }
+    if (unchanged == fb_height) {
+        return;
+    }
+
+    size_t lines = 0;
+    if (fb_height - unchanged >= scroll_step * 2) {
+        lines = find_scroll(src, unchanged);
+    }
+
+    // Out of ring, start over from the top. That must not draw over lines
+    // being shown, so with the window still that close to the top the frame
+    // is drawn in place instead.
+    if (lines != 0 && shown_line + lines + fb_height > virtual_height) {
+        if (shown_line < fb_height) {
+            lines = 0;
+        } else {
+            present_whole(src, 0);
+            memcpy(front_hashes, src_hashes, fb_height * sizeof(uint64_t));
+            if (!pan_to(0)) {
+                mode = PRESENT_SINGLE;
+                present_whole(src, shown_line);
+                return;
+            }
+            shown_line = 0;
+            rebases++;
+            return;
+        }
+    }
+
+    if (lines != 0) {
+        // Shift what stays like the window is about to, and draw the lines
+        // it exposes before showing them.
+        size_t kept = fb_height - lines;
+        blit->move(front, front + lines * fb_width, kept * fb_width);
+        memmove(front_hashes, front_hashes + lines, kept * sizeof(uint64_t));
+        uint8_t *page = line_base(shown_line + lines);
+        for (size_t y = kept; y < fb_height; y++) {
+            blit->copy(front + y * fb_width, src + y * fb_width, fb_width);
+            front_hashes[y] = src_hashes[y];
+            write_row_span(page, y, (struct span){ 0, fb_width });
+        }
+
+        if (!pan_to(shown_line + lines)) {
+            mode = PRESENT_SINGLE;
+            present_whole(src, shown_line);
+            return;
+        }
+        shown_line += lines;
+        scrolls++;
+        scrolled_lines += lines;
+    }
+
+    // Whatever else changed, such as the line the cursor is on.
+    uint8_t *page = line_base(shown_line);
+    for (size_t y = 0; y < fb_height; y++) {
+        struct span span;
+        if (diff_row(src + y * fb_width, front + y * fb_width, &span)) {
+            write_row_span(page, y, span);
+            front_hashes[y] = 0;
+        }
+    }
+}
+
+void fb_present(const uint32_t *src) {
+    switch (mode) {
+        case PRESENT_SINGLE: present_single(src);   break;
+        case PRESENT_FLIP:   present_flipped(src);  break;
+        case PRESENT_SCROLL: present_scrolled(src); break;
+    }
+}
+
+uint64_t fb_checksum(void) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < fb_width * fb_height; i++) {
+        hash = (hash ^ front[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+void fb_dump_stats(FILE *out) {
+    fprintf(out, "fb.bits_per_pixel %u\n", device_format.bits_per_pixel);
+    fprintf(out, "fb.shown_line %zu\n", shown_line);
+    fprintf(out, "fb.flips %llu\n", (unsigned long long)flips);
+    fprintf(out, "fb.scrolls %llu\n", (unsigned long long)scrolls);
+    fprintf(out, "fb.scrolled_lines %llu\n", (unsigned long long)scrolled_lines);
+    fprintf(out, "fb.rebases %llu\n", (unsigned long long)rebases);
+    fprintf(out, "fb.rows_presented %llu\n", (unsigned long long)rows_presented);
+    fprintf(out, "fb.bytes_presented %llu\n", (unsigned long long)bytes_presented);
+}
@@ -0,0 +1,72 @@
+/*
+    fb.h: Shadow framebuffer and presentation to the device
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FB_H
+#define FB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Layout of a device pixel, as in struct fb_var_screeninfo. Offsets and
+// lengths of the channels are in bits.
+struct fb_format {
+    unsigned int bits_per_pixel;
+    unsigned int red_offset, red_length;
+    unsigned int green_offset, green_length;
+    unsigned int blue_offset, blue_length;
+};
+
+// Whether fb_init() can present to devices of the passed format, 16, 24 or
+// 32 bits per pixel with channels of up to 8 bits.
+bool fb_format_supported(const struct fb_format *format);
+
+// Allocate a shadow buffer in RAM for the passed device mapping, with a
+// pitch of width pixels, and clear the device. The shadow is always 32 bit
+// xRGB and is converted to the device format when presented, device_pitch
+// being in bytes. Needs blit_init() first. Returns NULL on failure.
+uint32_t *fb_init(void *device, size_t width, size_t height, size_t device_pitch,
+                  const struct fb_format *format);
+
+// Present through two pages of the device mapping from now on, the second
+// right below the first, writing frames to the hidden one and calling pan
+// with its first line to show it. Falls back to a single page if pan ever
+// fails. Returns false if out of memory.
+bool fb_enable_flipping(bool (*pan)(size_t yoffset));
+
+// Present by panning over lines of the device mapping from now on instead,
+// three pages' worth or more, moving the shown lines down by multiples of
+// step when frames look like the last one scrolled and drawing only what
+// that exposes. Goes back to the first page when out of lines, which needs
+// the shown ones to be clear of it, hence the third page. Falls back
+// to a single page if pan ever fails. Returns false if out of memory.
+bool fb_enable_scrolling(bool (*pan)(size_t yoffset), size_t lines, size_t step);
+
+// Copy the spans of src that differ from what was last presented to the
+// device. src is the shadow or any other buffer of the same geometry, and
+// callers serialize this with rendering to it.
+void fb_present(const uint32_t *src);
+
+// Hash of what the device was last given, FNV-1a over whole pixels, to
+// compare runs by.
+uint64_t fb_checksum(void);
+
+void fb_dump_stats(FILE *out);
+
+#endif
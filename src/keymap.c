@@ -0,0 +1,137 @@
+/*
+    keymap.c: Flat scancode translation tables
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <keymap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char convtab_capslock[] = {
+    '\0', '\e', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
+    'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '[', ']', '\n', '\0', 'A', 'S',
+    'D', 'F', 'G', 'H', 'J', 'K', 'L', ';', '\'', '`', '\0', '\\', 'Z', 'X', 'C', 'V',
+    'B', 'N', 'M', ',', '.', '/', '\0', '\0', '\0', ' '
+};
+
+static const char convtab_shift[] = {
+    '\0', '\e', '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t',
+    'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', '\0', 'A', 'S',
+    'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', '\0', '|', 'Z', 'X', 'C', 'V',
+    'B', 'N', 'M', '<', '>', '?', '\0', '\0', '\0', ' '
+};
+
+static const char convtab_shift_capslock[] = {
+    '\0', '\e', '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t',
+    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '{', '}', '\n', '\0', 'a', 's',
+    'd', 'f', 'g', 'h', 'j', 'k', 'l', ':', '"', '~', '\0', '|', 'z', 'x', 'c', 'v',
+    'b', 'n', 'm', '<', '>', '?', '\0', '\0', '\0', ' '
+};
+
+static const char convtab_nomod[] = {
+    '\0', '\e', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
+    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', '\0', 'a', 's',
+    'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', '\0', '\\', 'z', 'x', 'c', 'v',
+    'b', 'n', 'm', ',', '.', '/', '\0', '\0', '\0', ' '
+};
+
+static const struct {
+    uint8_t scancode;
+    uint8_t flags;
+    const char *bytes;
+} extended_keys[] = {
+    {0x1c, 0,             "\n"},
+    {0x35, 0,             "/"},
+    {0x48, KEYMAP_CURSOR, "\e[A"}, // up arrow
+    {0x4b, KEYMAP_CURSOR, "\e[D"}, // left arrow
+    {0x50, KEYMAP_CURSOR, "\e[B"}, // down arrow
+    {0x4d, KEYMAP_CURSOR, "\e[C"}, // right arrow
+    {0x47, 0,             "\e[1~"}, // home
+    {0x4f, 0,             "\e[4~"}, // end
+    {0x49, 0,             "\e[5~"}, // pgup
+    {0x51, 0,             "\e[6~"}, // pgdown
+    {0x53, 0,             "\e[3~"}  // delete
+};
+
+static struct keymap_entry builtin[KEYMAP_ENTRIES];
+static bool builtin_ready = false;
+
+const struct keymap_entry *keymap_builtin(void) {
+    if (builtin_ready) {
+        return builtin;
+    }
+
+    const char *tables[KEYMAP_MOD_STATES] = {
+        [0]                                     = convtab_nomod,
+        [KEYMAP_MOD_SHIFT]                      = convtab_shift,
+        [KEYMAP_MOD_CAPSLOCK]                   = convtab_capslock,
+        [KEYMAP_MOD_SHIFT | KEYMAP_MOD_CAPSLOCK] = convtab_shift_capslock
+    };
+
+    for (unsigned mods = 0; mods < KEYMAP_MOD_STATES; mods++) {
+        for (size_t sc = 0; sc < sizeof(convtab_nomod); sc++) {
+            struct keymap_entry *e = &builtin[keymap_index(mods, false, sc)];
+            if (tables[mods][sc] != '\0') {
+                e->len = 1;
+                e->bytes[0] = tables[mods][sc];
+            }
+        }
+        for (size_t i = 0; i < sizeof(extended_keys) / sizeof(extended_keys[0]); i++) {
+            struct keymap_entry *e = &builtin[keymap_index(mods, true, extended_keys[i].scancode)];
+            e->len = strlen(extended_keys[i].bytes);
+            e->flags = extended_keys[i].flags;
+            memcpy(e->bytes, extended_keys[i].bytes, e->len);
+        }
+    }
+
+    builtin_ready = true;
+    return builtin;
+}
+
+const struct keymap_entry *keymap_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size != KEYMAP_FILE_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const char *map = mmap(NULL, KEYMAP_FILE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(map, KEYMAP_MAGIC, KEYMAP_MAGIC_SIZE) != 0) {
+        munmap((void *)map, KEYMAP_FILE_SIZE);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return (const struct keymap_entry *)(map + KEYMAP_MAGIC_SIZE);
+}
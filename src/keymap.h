@@ -0,0 +1,64 @@
+/*
+    keymap.h: Flat scancode translation tables
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A compiled keymap file is KEYMAP_MAGIC followed by KEYMAP_ENTRIES entries,
+// indexed by modifier state, the 0xe0 extended flag and the scancode. It is
+// only made of bytes, so the same file works on any host.
+#define KEYMAP_MAGIC "GCONKMP1"
+#define KEYMAP_MAGIC_SIZE 8
+#define KEYMAP_SCANCODES 128
+#define KEYMAP_MOD_STATES 4
+#define KEYMAP_ENTRIES (KEYMAP_MOD_STATES * 2 * KEYMAP_SCANCODES)
+#define KEYMAP_FILE_SIZE (KEYMAP_MAGIC_SIZE + KEYMAP_ENTRIES * sizeof(struct keymap_entry))
+
+#define KEYMAP_MOD_SHIFT 1
+#define KEYMAP_MOD_CAPSLOCK 2
+
+// Sends SS3 instead of CSI when the application cursor mode is on.
+#define KEYMAP_CURSOR 1
+
+struct keymap_entry {
+    uint8_t len;
+    uint8_t flags;
+    char bytes[6];
+};
+
+static inline size_t keymap_index(unsigned mods, bool extended, uint8_t scancode) {
+    return (mods * 2 + extended) * KEYMAP_SCANCODES + scancode;
+}
+
+static inline const struct keymap_entry *keymap_lookup(const struct keymap_entry *table,
+        bool shift, bool capslock, bool extended, uint8_t scancode) {
+    unsigned mods = (shift ? KEYMAP_MOD_SHIFT : 0) | (capslock ? KEYMAP_MOD_CAPSLOCK : 0);
+    return &table[keymap_index(mods, extended, scancode)];
+}
+
+// Map a compiled keymap, returns NULL on failure.
+const struct keymap_entry *keymap_load(const char *path);
+
+// US layout, used when no keymap file is given.
+const struct keymap_entry *keymap_builtin(void);
+
+#endif
@@ -16,9 +16,11 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <sys/ttydefaults.h>
@@ -31,54 +33,163 @@
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <font.h>
+#include <fb.h>
+#include <blit.h>
+#include <arena.h>
+#include <scrollback.h>
+#include <keymap.h>
+#include <trace.h>
+#include <record.h>
+#include <session.h>
 #include <ctype.h>
 #include <stdnoreturn.h>
 #include <pty.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 
-static char *const start_path = "/usr/bin/login";
-static char *const args[] = {start_path, NULL};
+static char *login_args[] = {"/usr/bin/login", NULL};
+static char *command_args[] = {"/bin/sh", "-c", NULL, NULL};
+static char **session_args = login_args;
 
+struct lock_stats {
+    uint64_t waits;
+    uint64_t wait_ns;
+};
+
+#define KBD_BUFFER_SIZE 1024
+#define REPLY_QUEUE_SIZE 256
+
+// ttys are only created once switched to, and let go of again when their
+// session exits while hidden. Everything but the lock and the statistics
+// below is only valid while created, which only changes under the lock.
 struct tty_info {
+    bool created;
     struct flanterm_context *context;
     int master_pty;
     int slave_pty;
-    int has_init_program;
+    pthread_mutex_t lock;
+    struct lock_stats lock_stats;
+    struct arena arena;
+    uint32_t *pixels;
+    bool has_snapshot;
+    struct scrollback scrollback;
+    bool has_scrollback;
+    size_t scroll_view;
+    struct termios termios;
+    uint64_t termios_ns;
+    bool passthrough;
+    char kbd_buffer[KBD_BUFFER_SIZE];
+    size_t kbd_buffer_i;
+    bool decckm;
+    // What callbacks asked for while parsing, done once the lock is let go.
+    char replies[REPLY_QUEUE_SIZE];
+    size_t replies_len;
+    unsigned int bells;
+    char *read_buffer;
+    bool bulk;
+    bool drained;
+    uint64_t budget;
+    uint64_t budget_ns;
+    uint64_t bytes_read;
 };
 
+#define MAX_TTYS 12
+
 static int  kb;
-static bool tty_mutex;
 int current_tty = 0;
-struct tty_info ttys[8];
+static int tty_count = 8;
+struct tty_info ttys[MAX_TTYS];
+static uint64_t ttys_created = 0;
+static uint64_t ttys_released = 0;
 
-static const char convtab_capslock[] = {
-    '\0', '\e', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
-    'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '[', ']', '\n', '\0', 'A', 'S',
-    'D', 'F', 'G', 'H', 'J', 'K', 'L', ';', '\'', '`', '\0', '\\', 'Z', 'X', 'C', 'V',
-    'B', 'N', 'M', ',', '.', '/', '\0', '\0', '\0', ' '
-};
+// What creating a tty needs, fixed once the framebuffer is set up. Contexts
+// are created from more than one thread, which this lock serializes, along
+// with the snapshot budget.
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *shared_shadow;
 
-static const char convtab_shift[] = {
-    '\0', '\e', '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t',
-    'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', '\0', 'A', 'S',
-    'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', '\0', '|', 'Z', 'X', 'C', 'V',
-    'B', 'N', 'M', '<', '>', '?', '\0', '\0', '\0', ' '
-};
+// Contexts paint all of their buffer when created, so one created on the
+// shared shadow wipes what the foreground drew there, which then has to be
+// drawn whole again. Only touched under fb_lock.
+static bool shadow_clobbered = false;
+static size_t frame_size;
+static struct termios pty_termios;
+static struct winsize pty_size;
+static bool has_sessions = false;
+static bool reader_threads = false;
 
-static const char convtab_shift_capslock[] = {
-    '\0', '\e', '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t',
-    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '{', '}', '\n', '\0', 'a', 's',
-    'd', 'f', 'g', 'h', 'j', 'k', 'l', ':', '"', '~', '\0', '|', 'z', 'x', 'c', 'v',
-    'b', 'n', 'm', '<', '>', '?', '\0', '\0', '\0', ' '
-};
+// Contexts only touch the framebuffer when flushing, so that is the only
+// thing serialized between ttys, everything else goes by the tty lock.
+static pthread_mutex_t fb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lock_stats fb_lock_stats;
 
-static const char convtab_nomod[] = {
-    '\0', '\e', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
-    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', '\0', 'a', 's',
-    'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', '\0', '\\', 'z', 'x', 'c', 'v',
-    'b', 'n', 'm', ',', '.', '/', '\0', '\0', '\0', ' '
-};
+// Foreground flushes are paced to at most one per period, output just
+// accumulates in the context in between. A period of 0 flushes after every
+// write instead.
+static uint64_t flush_period_ns = 1000000000 / 60;
+static uint64_t next_flush_ns = 0;
+static bool flush_pending = false;
+static bool flush_thread_running = false;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t frames_flushed = 0;
+
+// ttys within the snapshot budget render to a buffer of their own instead of
+// the shared shadow, which keeps their last frame around while hidden, and
+// switching to them only needs to draw what changed since.
+static size_t snapshot_budget = 0;
+
+static size_t scrollback_limit = 1000;
+
+// Nobody waits on what hidden ttys print, so they are read in bigger chunks
+// and only get to parse so many bytes per second, with bursts of up to a
+// tenth of that. Their output is written a slice at a time, so a switch to
+// them never waits long for their lock, and so is the foreground's when it
+// reads in bulk. A rate of 0 means no limit.
+#define MASTER_READ_SIZE 512
+#define HIDDEN_READ_SIZE 65536
+#define HIDDEN_WRITE_SLICE 4096
+#define BUDGET_RECHECK_NS 10000000
+static uint64_t background_rate = 2048 * 1024;
+
+// Output that comes in faster than it is read is gathered up into bigger
+// reads, and plain text in them that scrolls off before the end is never
+// drawn, like xterm's jump scroll. The scrollback still gets all of it.
+static bool jump_scrolling = true;
+static uint64_t jumps = 0;
+static uint64_t jumped_bytes = 0;
+
+// Text grid geometry, as flanterm centers it in the framebuffer.
+static size_t fb_width;
+static size_t fb_height;
+static size_t term_rows;
+static size_t term_cols;
+static size_t term_x_off;
+static size_t term_y_off;
+
+static uint64_t switches = 0;
+static uint64_t switch_ns = 0;
+static uint64_t switch_max_ns = 0;
+
+// Time from entering main to the first frame, and to the first one with
+// anything a session printed.
+static uint64_t start_ns;
+static uint64_t first_frame_ns = 0;
+static uint64_t first_output_ns = 0;
+
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t exit_requested = 0;
+static const char *stats_path = NULL;
+
+// Exit once the session on the first tty does, for headless runs.
+static bool exit_with_session = false;
+#ifdef GCON_TRACE
+static const char *trace_path = NULL;
+#endif
 
-#define SCANCODE_MAX 0x57
 #define SCANCODE_CTRL 0x1d
 #define SCANCODE_CTRL_REL 0x9d
 #define SCANCODE_SHIFT_RIGHT 0x36
@@ -89,77 +200,749 @@ static const char convtab_nomod[] = {
 #define SCANCODE_ALT_LEFT_REL 0xb8
 #define SCANCODE_CAPSLOCK 0x3a
 #define SCANCODE_NUMLOCK 0x45
+#define SCANCODE_PGUP 0x49
+#define SCANCODE_PGDOWN 0x51
 
-#define KBD_BUFFER_SIZE 1024
-static char kbd_buffer[KBD_BUFFER_SIZE];
-static size_t kbd_buffer_i = 0;
+static const struct keymap_entry *keymap;
+
+// Alt with one of these switches to the tty of its index.
+static const uint8_t tty_scancodes[MAX_TTYS] = {
+    0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x57, 0x58
+};
+
+// Everything one keyboard read produces for the master and for echo is
+// gathered here and sent with one write each once the read is processed.
+#define KBD_READ_SIZE 256
+#define INPUT_BATCH_SIZE 1024
+static char pty_batch[INPUT_BATCH_SIZE];
+static size_t pty_batch_len = 0;
+static char echo_batch[INPUT_BATCH_SIZE];
+static size_t echo_batch_len = 0;
+static uint64_t inputs_dropped = 0;
+
+// Programs can change termios at any time, but fetching it for every read
+// costs a syscall, so it is refetched at most this often.
+#define TERMIOS_REFRESH_NS 20000000
+
+// VGA colours, which are flanterm's defaults too. They are passed explicitly
+// so that whatever gcon draws itself matches the contexts. The first 8 are
+// the normal ANSI colours and the last 8 their bright variants.
+static uint32_t palette[16] = {
+    0x00000000, 0x00aa0000, 0x0000aa00, 0x00aa5500,
+    0x000000aa, 0x00aa00aa, 0x0000aaaa, 0x00aaaaaa,
+    0x00555555, 0x00ff5555, 0x0055ff55, 0x00ffff55,
+    0x005555ff, 0x00ff55ff, 0x0055ffff, 0x00ffffff
+};
+static uint32_t default_bg = 0x00000000;
+static uint32_t default_fg = 0x00aaaaaa;
 
-static bool decckm = false;
 static int pcspkr;
 
+// The tty whose output this thread is parsing, for callbacks to find it by.
+static _Thread_local struct tty_info *parsing_tty;
+
+// Bells closer together than this ring once. Only the foreground rings.
+#define BELL_INTERVAL_NS 100000000
+static uint64_t last_bell_ns = 0;
+static uint64_t bells_rung = 0;
+static uint64_t bells_suppressed = 0;
+static uint64_t reply_bytes = 0;
+static uint64_t replies_dropped = 0;
+
+// What FBIOPAN_DISPLAY is given to flip pages.
+static int fb;
+static struct fb_var_screeninfo pan_info;
+
+// Keyboard modifier state, shared by whatever context processes scancodes.
+static bool extra_scancodes = false;
+static bool ctrl_active = false;
+//static bool numlock_active = false;
+static bool alt_active = false;
+static bool shift_active = false;
+static bool capslock_active = false;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Take a lock, accounting for the time spent blocked if it was contended.
+static void lock_timed(pthread_mutex_t *lock, struct lock_stats *stats) {
+    if (pthread_mutex_trylock(lock) == 0) {
+        return;
+    }
+
+    uint64_t start = now_ns();
+    pthread_mutex_lock(lock);
+    __atomic_add_fetch(&stats->waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void dump_lock_stats(FILE *out, const char *name, struct lock_stats *stats) {
+    fprintf(out, "%s.lock_waits %llu\n", name,
+        (unsigned long long)__atomic_load_n(&stats->waits, __ATOMIC_RELAXED));
+    fprintf(out, "%s.lock_wait_ns %llu\n", name,
+        (unsigned long long)__atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED));
+}
+
+static void dump_stats(FILE *out) {
+    char name[16];
+    for (int i = 0; i < tty_count; i++) {
+        snprintf(name, sizeof(name), "tty%d", i);
+        fprintf(out, "%s.created %d\n", name, __atomic_load_n(&ttys[i].created, __ATOMIC_ACQUIRE));
+        dump_lock_stats(out, name, &ttys[i].lock_stats);
+        fprintf(out, "%s.arena_held %zu\n", name, ttys[i].arena.held);
+        fprintf(out, "%s.arena_reserved %zu\n", name, ttys[i].arena.reserved);
+        fprintf(out, "%s.bytes_read %llu\n", name,
+            (unsigned long long)__atomic_load_n(&ttys[i].bytes_read, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "tty.created %llu\n",
+        (unsigned long long)__atomic_load_n(&ttys_created, __ATOMIC_RELAXED));
+    fprintf(out, "tty.released %llu\n",
+        (unsigned long long)__atomic_load_n(&ttys_released, __ATOMIC_RELAXED));
+    fprintf(out, "startup.first_frame_ns %llu\n",
+        (unsigned long long)__atomic_load_n(&first_frame_ns, __ATOMIC_RELAXED));
+    fprintf(out, "startup.first_output_ns %llu\n",
+        (unsigned long long)__atomic_load_n(&first_output_ns, __ATOMIC_RELAXED));
+    dump_lock_stats(out, "fb", &fb_lock_stats);
+    fprintf(out, "fb.frames %llu\n",
+        (unsigned long long)__atomic_load_n(&frames_flushed, __ATOMIC_RELAXED));
+    fprintf(out, "reply.bytes %llu\n",
+        (unsigned long long)__atomic_load_n(&reply_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "reply.dropped %llu\n",
+        (unsigned long long)__atomic_load_n(&replies_dropped, __ATOMIC_RELAXED));
+    fprintf(out, "input.dropped %llu\n",
+        (unsigned long long)__atomic_load_n(&inputs_dropped, __ATOMIC_RELAXED));
+    fprintf(out, "bell.rung %llu\n",
+        (unsigned long long)__atomic_load_n(&bells_rung, __ATOMIC_RELAXED));
+    fprintf(out, "bell.suppressed %llu\n",
+        (unsigned long long)__atomic_load_n(&bells_suppressed, __ATOMIC_RELAXED));
+    fprintf(out, "jump.count %llu\n",
+        (unsigned long long)__atomic_load_n(&jumps, __ATOMIC_RELAXED));
+    fprintf(out, "jump.bytes %llu\n",
+        (unsigned long long)__atomic_load_n(&jumped_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "switch.count %llu\n", (unsigned long long)switches);
+    fprintf(out, "switch.total_ns %llu\n", (unsigned long long)switch_ns);
+    fprintf(out, "switch.max_ns %llu\n", (unsigned long long)switch_max_ns);
+    fb_dump_stats(out);
+    session_dump_stats(out);
+    TRACE_DUMP_STATS(out);
+    fflush(out);
+}
+
+static void note_first(uint64_t *at) {
+    uint64_t unset = 0;
+    if (__atomic_load_n(at, __ATOMIC_RELAXED) == 0) {
+        __atomic_compare_exchange_n(at, &unset, now_ns() - start_ns, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+// Draw whatever the context has queued, must be called with its tty lock.
+// Nothing is drawn while scrolled back, output just accumulates.
+static void flush_locked(struct tty_info *tty) {
+    if (tty->scroll_view != 0) {
+        return;
+    }
+
+    TRACE_START(start);
+    lock_timed(&fb_lock, &fb_lock_stats);
+    if (shadow_clobbered && tty->pixels == shared_shadow) {
+        flanterm_full_refresh(tty->context);
+        shadow_clobbered = false;
+    }
+    flanterm_flush(tty->context);
+    fb_present(tty->pixels);
+    pthread_mutex_unlock(&fb_lock);
+    __atomic_add_fetch(&frames_flushed, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&tty->bytes_read, __ATOMIC_RELAXED) != 0) {
+        note_first(&first_output_ns);
+    }
+    TRACE_SPAN(TRACE_FLUSH, tty - ttys, start);
+    TRACE_PRESENTED();
+}
+
+static void flush_foreground(void) {
+    int tty_idx = __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE);
+    struct tty_info *tty = &ttys[tty_idx];
+    lock_timed(&tty->lock, &tty->lock_stats);
+
+    // Writers set the flag under the tty lock, so clearing it here cannot
+    // lose a request for output we are not about to draw.
+    __atomic_store_n(&flush_pending, false, __ATOMIC_RELEASE);
+    next_flush_ns = now_ns() + flush_period_ns;
+
+    // If a switch happened in the meantime it already drew everything.
+    if (tty_idx == __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE)) {
+        flush_locked(tty);
+    }
+    pthread_mutex_unlock(&tty->lock);
+}
+
+static void request_flush(struct tty_info *tty) {
+    if (flush_period_ns == 0) {
+        flush_locked(tty);
+        return;
+    }
+
+    if (!__atomic_exchange_n(&flush_pending, true, __ATOMIC_ACQ_REL) && flush_thread_running) {
+        pthread_mutex_lock(&flush_mutex);
+        pthread_cond_signal(&flush_cond);
+        pthread_mutex_unlock(&flush_mutex);
+    }
+}
+
+static noreturn void *flush_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&flush_mutex);
+        while (!__atomic_load_n(&flush_pending, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&flush_cond, &flush_mutex);
+        }
+        pthread_mutex_unlock(&flush_mutex);
+
+        struct timespec deadline = {
+            .tv_sec  = next_flush_ns / 1000000000,
+            .tv_nsec = next_flush_ns % 1000000000
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+        flush_foreground();
+    }
+}
+
+// Written to on every signal, for the event loop to wake up to ones that
+// come while it is not polling.
+static int signal_pipe[2] = {-1, -1};
+
+static void handle_signal(int sig) {
+    if (sig == SIGUSR1) {
+        stats_requested = 1;
+    } else {
+        exit_requested = 1;
+    }
+    if (signal_pipe[1] != -1) {
+        int saved_errno = errno;
+        if (write(signal_pipe[1], "", 1) == -1) {
+            // Full, there is enough to wake up to already.
+        }
+        errno = saved_errno;
+    }
+}
+
+// Draw what is pending and leave, writing the stats out if asked to.
+static noreturn void finish(int status) {
+    flush_foreground();
+    record_close();
+    if (stats_path != NULL) {
+        FILE *out = fopen(stats_path, "w");
+        if (out == NULL) {
+            perror("Could not write stats");
+            exit(1);
+        }
+        dump_stats(out);
+        fclose(out);
+    }
+    exit(status);
+}
+
+static void check_signals(void) {
+    if (stats_requested) {
+        stats_requested = 0;
+        dump_stats(stderr);
+#ifdef GCON_TRACE
+        if (trace_path != NULL && !trace_dump_chrome(trace_path)) {
+            perror("Could not write trace");
+        }
+#endif
+    }
+    if (exit_requested) {
+        finish(0);
+    }
+}
+
+// Coalesce bells into one per interval, rung by whoever gets there first.
+static void ring_bell(unsigned int count) {
+    uint64_t now = now_ns();
+    uint64_t last = __atomic_load_n(&last_bell_ns, __ATOMIC_RELAXED);
+    if (now - last < BELL_INTERVAL_NS ||
+        !__atomic_compare_exchange_n(&last_bell_ns, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&bells_suppressed, count, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&bells_suppressed, count - 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bells_rung, 1, __ATOMIC_RELAXED);
+
+    // The speaker may well block for as long as it sounds.
+    uint32_t frequency = 1000;
+    ioctl(pcspkr, 0, &frequency);
+}
+
 static void locked_term_write(int tty_idx, const char *msg, size_t len) {
-    while (__atomic_test_and_set(&tty_mutex, __ATOMIC_SEQ_CST)) {
-        sched_yield();
+    struct tty_info *tty = &ttys[tty_idx];
+    lock_timed(&tty->lock, &tty->lock_stats);
+    if (tty->has_scrollback) {
+        scrollback_feed(&tty->scrollback, msg, len);
+    }
+    TRACE_START(start);
+    parsing_tty = tty;
+    flanterm_write(tty->context, msg, len);
+    parsing_tty = NULL;
+    TRACE_SPAN(TRACE_TERM_WRITE, tty_idx, start);
+
+    // The foreground cannot change while we hold its lock.
+    bool foreground = tty_idx == __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE);
+    if (foreground) {
+        TRACE_OUTPUT();
+        request_flush(tty);
+    }
+
+    // Replies and bells wait until the lock is let go, so neither a full
+    // PTY nor the speaker holds up drawing or switching.
+    char replies[REPLY_QUEUE_SIZE];
+    size_t replies_len = tty->replies_len;
+    unsigned int bells = tty->bells;
+    int master = tty->master_pty;
+    if (replies_len != 0) {
+        memcpy(replies, tty->replies, replies_len);
+        tty->replies_len = 0;
     }
-    flanterm_write(ttys[tty_idx].context, msg, len);
-    __atomic_clear(&tty_mutex, __ATOMIC_SEQ_CST);
+    tty->bells = 0;
+    pthread_mutex_unlock(&tty->lock);
+
+    // Replays have nobody to reply to, and nobody reading their masters.
+    // What does not fit in the input of a session that stopped reading it
+    // is dropped.
+    if (replies_len != 0 && has_sessions) {
+        ssize_t written = write(master, replies, replies_len);
+        if (written > 0) {
+            __atomic_add_fetch(&reply_bytes, written, __ATOMIC_RELAXED);
+        }
+        if (written < (ssize_t)replies_len) {
+            __atomic_add_fetch(&replies_dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (bells != 0 && foreground) {
+        ring_bell(bells);
+    }
+}
+
+// Skip drawing the plain text at the start of buf that scrolls off before
+// the rest is drawn, see scrollback_jump(). The scrollback is what follows
+// the stream for it, so ttys without one never skip. Returns how many bytes
+// were dealt with, the rest goes through locked_term_write() as usual.
+static size_t jump_scroll(int tty_idx, const char *buf, size_t len) {
+    struct tty_info *tty = &ttys[tty_idx];
+    if (!jump_scrolling) {
+        return 0;
+    }
+    lock_timed(&tty->lock, &tty->lock_stats);
+    size_t skip = 0;
+    if (tty->has_scrollback) {
+        skip = scrollback_jump(&tty->scrollback, buf, len);
+    }
+    if (skip != 0) {
+        scrollback_feed(&tty->scrollback, buf, skip);
+        char jump[32];
+        int jump_len = snprintf(jump, sizeof(jump), "\033[2J\033[%zu;1H", term_rows);
+        flanterm_write(tty->context, jump, jump_len);
+        __atomic_add_fetch(&jumps, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&jumped_bytes, skip, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tty->lock);
+    return skip;
+}
+
+static void queue_reply(struct tty_info *tty, const char *reply, size_t len) {
+    if (tty->replies_len + len > REPLY_QUEUE_SIZE) {
+        __atomic_add_fetch(&replies_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(tty->replies + tty->replies_len, reply, len);
+    tty->replies_len += len;
 }
 
-static void dec_private(uint64_t esc_val_count, uint32_t *esc_values, uint64_t final) {
+static void dec_private(struct tty_info *tty, uint64_t esc_val_count, uint32_t *esc_values, uint64_t final) {
     (void)esc_val_count;
 
     switch (esc_values[0]) {
         case 1:
             switch (final) {
-                case 'h': decckm = true;  break;
-                case 'l': decckm = false; break;
+                case 'h': tty->decckm = true;  break;
+                case 'l': tty->decckm = false; break;
             }
     }
 }
 
+// Called from flanterm_write(), with the lock of the tty being parsed held.
 static void flanterm_callback(struct flanterm_context *t1, uint64_t t, uint64_t a, uint64_t b, uint64_t c) {
     (void)t1;
+    struct tty_info *tty = parsing_tty;
+    if (tty == NULL) {
+        return;
+    }
 
     switch (t) {
         case FLANTERM_CB_DEC:
-            dec_private(a, (void *)b, c);
+            dec_private(tty, a, (void *)b, c);
             break;
         case FLANTERM_CB_BELL:
-            uint32_t frequency = 1000;
-            ioctl(pcspkr, 0, &frequency);
+            tty->bells++;
+            break;
+        case FLANTERM_CB_PRIVATE_ID:
+            // A VT102, like the Linux console says it is.
+            queue_reply(tty, "\033[?6c", 5);
+            break;
+        case FLANTERM_CB_STATUS_REPORT:
+            queue_reply(tty, "\033[0n", 4);
             break;
+        case FLANTERM_CB_POS_REPORT: {
+            // flanterm passes the column first, reports go row first.
+            char report[48];
+            int len = snprintf(report, sizeof(report), "\033[%llu;%lluR",
+                               (unsigned long long)b, (unsigned long long)a);
+            queue_reply(tty, report, len);
+            break;
+        }
+    }
+}
+
+static void *master_input_thread(void *arg);
+
+// Common termios for all terminals. It starts zeroed, so that nothing is
+// left to whatever the libc puts in fields we do not set, and the speed is
+// given through cfsetispeed()/cfsetospeed(), as where it is stored differs
+// between systems. Erase and kill match what the keymap sends.
+static void init_pty_termios(void) {
+    pty_termios = (struct termios){0};
+    pty_termios.c_iflag = BRKINT | IGNPAR | ICRNL | IXON | IMAXBEL;
+    pty_termios.c_oflag = OPOST | ONLCR;
+    pty_termios.c_cflag = CS8 | CREAD;
+    pty_termios.c_lflag = ISIG | ICANON | ECHO | ECHOE | ECHOK | ECHOCTL | ECHOKE;
+    pty_termios.c_cc[VINTR] = CTRL('C');
+    pty_termios.c_cc[VEOF] = CTRL('D');
+    pty_termios.c_cc[VSUSP] = CTRL('Z');
+    pty_termios.c_cc[VERASE] = '\b';
+    pty_termios.c_cc[VKILL] = CTRL('U');
+    pty_termios.c_cc[VMIN] = 1;
+    cfsetispeed(&pty_termios, B38400);
+    cfsetospeed(&pty_termios, B38400);
+}
+
+static bool open_pty(int *master, int *slave) {
+    if (openpty(master, slave, NULL, &pty_termios, &pty_size) == -1) {
+        return false;
+    }
+
+    // Sessions only get their own slave. Nothing written to a master may
+    // wait on its session reading its input, readers poll it instead.
+    fcntl(*master, F_SETFD, FD_CLOEXEC);
+    fcntl(*master, F_SETFL, fcntl(*master, F_GETFL) | O_NONBLOCK);
+    fcntl(*slave, F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+// Readers leave signals to the main thread, whichever thread creates them.
+static void start_reader(int tty_idx) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, master_input_thread, (void *)(intptr_t)tty_idx)) {
+        perror("Could not create master thread!");
+    } else {
+        pthread_detach(thread);
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Set up a tty's context and pty, with its lock held. Returns false with
+// errno set on failure, leaving it as it was.
+static bool create_tty(int tty_idx) {
+    struct tty_info *tty = &ttys[tty_idx];
+
+    // Keep the context's buffers together in its own arena, including its
+    // snapshot if it fits in the budget.
+    pthread_mutex_lock(&create_lock);
+    tty->pixels = shared_shadow;
+    tty->has_snapshot = false;
+    if (snapshot_budget >= frame_size) {
+        uint32_t *snapshot = arena_alloc(&tty->arena, frame_size);
+        if (snapshot != NULL) {
+            tty->pixels = snapshot;
+            tty->has_snapshot = true;
+            snapshot_budget -= frame_size;
+        }
+    }
+
+    // Nothing may draw to the shared shadow meanwhile.
+    bool shared = !tty->has_snapshot;
+    if (shared) {
+        lock_timed(&fb_lock, &fb_lock_stats);
+    }
+    arena_select(&tty->arena);
+    tty->context = flanterm_fb_init(
+        arena_selected_alloc,
+        arena_selected_free,
+        tty->pixels,
+        fb_width,
+        fb_height,
+        // The shadow is xRGB whatever the device is.
+        fb_width * sizeof(uint32_t),
+        8, 16, 8, 8, 8, 0,
+        NULL,
+        palette, palette + 8,
+        &default_bg, &default_fg,
+        NULL, NULL,
+        unifont_arr, FONT_WIDTH, FONT_HEIGHT, 0,
+        1, 1,
+        0
+    );
+    if (shared) {
+        shadow_clobbered = true;
+        pthread_mutex_unlock(&fb_lock);
+    }
+    if (tty->context != NULL) {
+        flanterm_get_dimensions(tty->context, &term_cols, &term_rows);
+    }
+    pthread_mutex_unlock(&create_lock);
+
+    if (tty->context != NULL) {
+        tty->has_scrollback = scrollback_limit != 0 && scrollback_init(
+            &tty->scrollback,
+            &tty->arena,
+            scrollback_limit,
+            term_cols,
+            term_rows
+        );
+        tty->read_buffer = arena_alloc(&tty->arena, HIDDEN_READ_SIZE);
+    }
+    if (tty->context == NULL || tty->read_buffer == NULL ||
+        !open_pty(&tty->master_pty, &tty->slave_pty)) {
+        int saved_errno = errno;
+        pthread_mutex_lock(&create_lock);
+        if (tty->has_snapshot) {
+            snapshot_budget += frame_size;
+        }
+        pthread_mutex_unlock(&create_lock);
+        arena_release(&tty->arena);
+        errno = saved_errno;
+        return false;
+    }
+
+    flanterm_set_callback(tty->context, flanterm_callback);
+    flanterm_set_autoflush(tty->context, false);
+    tty->scroll_view = 0;
+    tty->kbd_buffer_i = 0;
+    tty->bulk = false;
+    tty->drained = true;
+    tty->decckm = false;
+    tty->replies_len = 0;
+    tty->bells = 0;
+    tty->termios_ns = 0;
+    tty->budget = 0;
+    tty->budget_ns = now_ns();
+
+    if (has_sessions) {
+        session_add(tty_idx, tty->slave_pty, !(exit_with_session && tty_idx == 0));
+    }
+    __atomic_store_n(&tty->created, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ttys_created, 1, __ATOMIC_RELAXED);
+    if (reader_threads) {
+        start_reader(tty_idx);
+    }
+    return true;
+}
+
+// Create a tty if it is not yet. Returns false with errno set on failure.
+static bool ensure_tty(int tty_idx) {
+    struct tty_info *tty = &ttys[tty_idx];
+    lock_timed(&tty->lock, &tty->lock_stats);
+    bool ready = tty->created || create_tty(tty_idx);
+    pthread_mutex_unlock(&tty->lock);
+    return ready;
+}
+
+// Called by the supervisor, the first tty is always kept, and so is the
+// one being looked at.
+static bool tty_releasable(int tty_idx) {
+    return tty_idx != 0 && tty_idx != __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE);
+}
+
+// The supervisor let go of a tty's slave, and its master hung up. Drop the
+// tty, unless it was switched to since, then it gets a new pty instead,
+// and a session on it. Returns whether the tty is still there.
+static bool tty_hangup(int tty_idx) {
+    struct tty_info *tty = &ttys[tty_idx];
+    lock_timed(&tty->lock, &tty->lock_stats);
+    if (tty_idx == __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE)) {
+        // The keyboard writes to the foreground's master without its lock,
+        // so the descriptor is replaced rather than closed and reopened.
+        int master, slave;
+        bool reopened = open_pty(&master, &slave) && dup2(master, tty->master_pty) != -1;
+        if (reopened) {
+            close(master);
+            fcntl(tty->master_pty, F_SETFD, FD_CLOEXEC);
+            tty->slave_pty = slave;
+            session_add(tty_idx, slave, true);
+            session_request(tty_idx);
+        } else {
+            perror("Could not reopen pty");
+        }
+        pthread_mutex_unlock(&tty->lock);
+        return reopened;
+    }
+
+    // Everything the context allocated is in the arena, releasing it is
+    // all flanterm_deinit() would do. The supervisor closed the slave.
+    __atomic_store_n(&tty->created, false, __ATOMIC_RELEASE);
+    close(tty->master_pty);
+    tty->master_pty = -1;
+    tty->slave_pty = -1;
+    pthread_mutex_lock(&create_lock);
+    if (tty->has_snapshot) {
+        snapshot_budget += frame_size;
+    }
+    pthread_mutex_unlock(&create_lock);
+    arena_release(&tty->arena);
+    tty->context = NULL;
+    tty->pixels = NULL;
+    tty->has_snapshot = false;
+    tty->has_scrollback = false;
+    tty->read_buffer = NULL;
+    __atomic_add_fetch(&ttys_released, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tty->lock);
+    return false;
 }
 
 static void do_tty_switch(int tty_idx) {
-    while (__atomic_test_and_set(&tty_mutex, __ATOMIC_SEQ_CST)) {
-        sched_yield();
+    uint64_t start = now_ns();
+
+    // Created before taking the locks, so the foreground is not held up.
+    if (!ensure_tty(tty_idx)) {
+        perror("Could not create tty");
+        return;
+    }
+    record_switch(tty_idx);
+
+    // Lock both ttys in index order, so writers can rely on the foreground
+    // not changing under their tty lock.
+    int old_tty = current_tty;
+    int first  = old_tty < tty_idx ? old_tty : tty_idx;
+    int second = old_tty < tty_idx ? tty_idx : old_tty;
+    lock_timed(&ttys[first].lock, &ttys[first].lock_stats);
+    if (second != first) {
+        lock_timed(&ttys[second].lock, &ttys[second].lock_stats);
     }
 
-    flanterm_set_autoflush(ttys[current_tty].context, false);
-    flanterm_set_autoflush(ttys[tty_idx].context, true);
-    flanterm_full_refresh(ttys[tty_idx].context);
-    flanterm_flush(ttys[tty_idx].context);
-    current_tty = tty_idx;
+    // Its session may have exited and let go of it in the meantime. It is
+    // created before taking fb_lock, which creating takes itself.
+    bool ready = ttys[tty_idx].created || create_tty(tty_idx);
+    if (ready) {
+        lock_timed(&fb_lock, &fb_lock_stats);
 
-    if (!ttys[tty_idx].has_init_program) {
-        int child = fork();
-        if (child == 0) {
-           // Replace std streams.
-           dup2(ttys[tty_idx].slave_pty, 0);
-           dup2(ttys[tty_idx].slave_pty, 1);
-           dup2(ttys[tty_idx].slave_pty, 2);
-           ioctl(ttys[tty_idx].slave_pty, TIOCSCTTY, NULL);
-           execvp(start_path, args);
-           perror("Could not start");
+        // A snapshot is still intact and only needs what was queued since
+        // it was hidden, otherwise the shared shadow has to be redrawn
+        // whole. The same goes for a tty that was left scrolled back.
+        if (!ttys[tty_idx].has_snapshot || ttys[tty_idx].scroll_view != 0) {
+            ttys[tty_idx].scroll_view = 0;
+            flanterm_full_refresh(ttys[tty_idx].context);
         }
-        ttys[tty_idx].has_init_program = 1;
+        if (!ttys[tty_idx].has_snapshot) {
+            shadow_clobbered = false;
+        }
+        flanterm_flush(ttys[tty_idx].context);
+        fb_present(ttys[tty_idx].pixels);
+        __atomic_add_fetch(&frames_flushed, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&current_tty, tty_idx, __ATOMIC_RELEASE);
+        note_first(&first_frame_ns);
+        pthread_mutex_unlock(&fb_lock);
+    }
+
+    if (second != first) {
+        pthread_mutex_unlock(&ttys[second].lock);
     }
+    pthread_mutex_unlock(&ttys[first].lock);
+    if (!ready) {
+        perror("Could not create tty");
+        return;
+    }
+
+    // Its session, if it has none, is started by the supervisor meanwhile.
+    session_request(tty_idx);
 
-    __atomic_clear(&tty_mutex, __ATOMIC_SEQ_CST);
+    uint64_t elapsed = now_ns() - start;
+    switches++;
+    switch_ns += elapsed;
+    if (elapsed > switch_max_ns) {
+        switch_max_ns = elapsed;
+    }
+}
+
+// Input that does not fit in what the session has yet to read is lost, as
+// the keyboard must not wait on it. Each short write counts as a drop.
+static void write_input(const char *data, size_t len) {
+    // Replays have nobody reading their masters.
+    if (!has_sessions) {
+        return;
+    }
+    TRACE_START(start);
+    ssize_t written = write(ttys[current_tty].master_pty, data, len);
+    TRACE_SPAN(TRACE_PTY_WRITE, current_tty, start);
+    if (written == -1 || (size_t)written < len) {
+        __atomic_add_fetch(&inputs_dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// The echo goes first, so the line feed that ends a line is on screen before
+// anything the session prints in reply to it.
+static void flush_input_batch(void) {
+    if (echo_batch_len != 0) {
+        locked_term_write(current_tty, echo_batch, echo_batch_len);
+        echo_batch_len = 0;
+    }
+    if (pty_batch_len != 0) {
+        write_input(pty_batch, pty_batch_len);
+        pty_batch_len = 0;
+    }
+}
+
+static void batch_pty(const char *data, size_t len) {
+    if (pty_batch_len + len > INPUT_BATCH_SIZE) {
+        flush_input_batch();
+    }
+    if (len > INPUT_BATCH_SIZE) {
+        write_input(data, len);
+        return;
+    }
+    memcpy(pty_batch + pty_batch_len, data, len);
+    pty_batch_len += len;
+}
+
+static void batch_echo(const char *data, size_t len) {
+    if (echo_batch_len + len > INPUT_BATCH_SIZE) {
+        flush_input_batch();
+    }
+    memcpy(echo_batch + echo_batch_len, data, len);
+    echo_batch_len += len;
+}
+
+static struct termios *input_termios(void) {
+    struct tty_info *tty = &ttys[current_tty];
+    uint64_t now = now_ns();
+    if (!tty->passthrough && now - tty->termios_ns >= TERMIOS_REFRESH_NS) {
+        if (tcgetattr(tty->master_pty, &tty->termios) < 0) {
+            perror("Could not fetch termios for keyboard input");
+        }
+        tty->termios_ns = now;
+    }
+    return &tty->termios;
 }
 
 static void add_to_buf_char(struct termios *termios, char c, bool echo) {
+    struct tty_info *tty = &ttys[current_tty];
     if (c == '\r' && ((termios->c_iflag & IGNCR) != 0)) {
         return;
     }
@@ -177,269 +960,786 @@ static void add_to_buf_char(struct termios *termios, char c, bool echo) {
     if (termios->c_lflag & ICANON) {
         switch (c) {
             case '\n': {
-                if (kbd_buffer_i == KBD_BUFFER_SIZE) {
+                if (tty->kbd_buffer_i == KBD_BUFFER_SIZE) {
                     return;
                 }
-                kbd_buffer[kbd_buffer_i++] = c;
+                tty->kbd_buffer[tty->kbd_buffer_i++] = c;
                 if (echo && (termios->c_lflag & ECHO)) {
-                    locked_term_write(current_tty, "\n", 1);
+                    batch_echo("\n", 1);
                 }
-                write(ttys[current_tty].master_pty, kbd_buffer, kbd_buffer_i);
-                kbd_buffer_i = 0;
+                batch_pty(tty->kbd_buffer, tty->kbd_buffer_i);
+                tty->kbd_buffer_i = 0;
                 return;
             }
             case '\b': {
-                if (kbd_buffer_i == 0) {
+                if (tty->kbd_buffer_i == 0) {
                     return;
                 }
-                kbd_buffer_i--;
+                tty->kbd_buffer_i--;
                 size_t to_backspace;
-                if (kbd_buffer[kbd_buffer_i] >= 0x01 && kbd_buffer[kbd_buffer_i] <= 0x1f) {
+                if (tty->kbd_buffer[tty->kbd_buffer_i] >= 0x01 && tty->kbd_buffer[tty->kbd_buffer_i] <= 0x1f) {
                     to_backspace = 2;
                 } else {
                     to_backspace = 1;
                 }
-                kbd_buffer[kbd_buffer_i] = 0;
+                tty->kbd_buffer[tty->kbd_buffer_i] = 0;
                 if (echo && (termios->c_lflag & ECHO) != 0) {
                     for (size_t i = 0; i < to_backspace; i++) {
-                        locked_term_write(current_tty, "\b \b", 3);
+                        batch_echo("\b \b", 3);
                     }
                 }
                 return;
             }
         }
 
-        if (kbd_buffer_i == KBD_BUFFER_SIZE) {
+        if (tty->kbd_buffer_i == KBD_BUFFER_SIZE) {
             return;
         }
-        kbd_buffer[kbd_buffer_i++] = c;
+        tty->kbd_buffer[tty->kbd_buffer_i++] = c;
     } else {
-        write(ttys[current_tty].master_pty, &c, 1);
+        batch_pty(&c, 1);
     }
 
     if (echo && (termios->c_lflag & ECHO) != 0) {
         if (c >= 0x20 && c <= 0x7e) {
-            locked_term_write(current_tty, &c, 1);
+            batch_echo(&c, 1);
         } else if (c >= 0x01 && c <= 0x1f) {
             char caret[2];
             caret[0] = '^';
             caret[1] = c + 0x40;
-            locked_term_write(current_tty, caret, 2);
+            batch_echo(caret, 2);
+        }
+    }
+}
+
+// Move the foreground tty's scrollback view by delta lines, clamped to the
+// history it has. Getting back to 0 returns to the live screen.
+static void scroll_view(long delta) {
+    struct tty_info *tty = &ttys[current_tty];
+    if (!tty->has_scrollback) {
+        return;
+    }
+    lock_timed(&tty->lock, &tty->lock_stats);
+
+    long view = (long)tty->scroll_view + delta;
+    long max = scrollback_lines(&tty->scrollback);
+    view = view < 0 ? 0 : (view > max ? max : view);
+    if ((size_t)view != tty->scroll_view) {
+        tty->scroll_view = view;
+        lock_timed(&fb_lock, &fb_lock_stats);
+        if (view == 0) {
+            flanterm_full_refresh(tty->context);
+            flanterm_flush(tty->context);
+            if (tty->pixels == shared_shadow) {
+                shadow_clobbered = false;
+            }
+        } else {
+            scrollback_render(&tty->scrollback, view, unifont_arr, tty->pixels,
+                              fb_width, term_x_off, term_y_off, palette);
         }
+        fb_present(tty->pixels);
+        pthread_mutex_unlock(&fb_lock);
     }
+
+    pthread_mutex_unlock(&tty->lock);
 }
 
 static void add_to_buf(struct termios *termios, char *ptr, size_t count, bool echo) {
+    // Typing anything snaps back to the live screen.
+    if (ttys[current_tty].scroll_view != 0) {
+        scroll_view(-(long)ttys[current_tty].scroll_view);
+    }
+
+    // Pass-through ttys leave line editing and echo to the PTY.
+    if (ttys[current_tty].passthrough) {
+        batch_pty(ptr, count);
+        return;
+    }
+
     for (size_t i = 0; i < count; i++) {
         add_to_buf_char(termios, ptr[i], echo);
     }
 }
 
+static void send_key(struct termios *config, const struct keymap_entry *key) {
+    char bytes[sizeof(key->bytes)];
+    memcpy(bytes, key->bytes, key->len);
+    if ((key->flags & KEYMAP_CURSOR) && ttys[current_tty].decckm && key->len > 1) {
+        bytes[1] = 'O';
+    }
+
+    // Enter sends a carriage return like any other terminal, the line
+    // discipline is the one to turn it into a newline if it wants to.
+    if (ttys[current_tty].passthrough && key->len == 1 && bytes[0] == '\n') {
+        bytes[0] = '\r';
+    }
+
+    // Backspace sends whatever the session erases with, which it may have
+    // changed from the '\b' it starts out with. Pass-through ttys do not
+    // keep their termios up to date, so it is fetched here.
+    if (ttys[current_tty].passthrough && key->len == 1 && bytes[0] == '\b') {
+        struct termios current;
+        if (tcgetattr(ttys[current_tty].master_pty, &current) == 0 &&
+            current.c_cc[VERASE] != _POSIX_VDISABLE) {
+            bytes[0] = current.c_cc[VERASE];
+        }
+    }
+    add_to_buf(config, bytes, key->len, true);
+}
+
+static void handle_kb_input(void) {
+    uint8_t input_bytes[KBD_READ_SIZE];
+    ssize_t count = read(kb, &input_bytes, KBD_READ_SIZE);
+    if (count <= 0) {
+        return;
+    }
+    TRACE_INSTANT(TRACE_KBD_READ, current_tty);
+    TRACE_INPUT();
+    struct termios *config = input_termios();
+
+    for (ssize_t i = 0; i < count; i++) {
+        if (input_bytes[i] == 0xe0) {
+            extra_scancodes = true;
+            continue;
+        }
+
+        bool extended = extra_scancodes;
+        extra_scancodes = false;
+
+        // Extended keys with a translation of their own send it no matter
+        // the modifiers, the rest behave like their plain counterparts.
+        if (extended && input_bytes[i] < KEYMAP_SCANCODES) {
+            if (shift_active && input_bytes[i] == SCANCODE_PGUP) {
+                flush_input_batch();
+                scroll_view(term_rows / 2);
+                continue;
+            }
+            if (shift_active && input_bytes[i] == SCANCODE_PGDOWN) {
+                flush_input_batch();
+                scroll_view(-(long)(term_rows / 2));
+                continue;
+            }
+
+            const struct keymap_entry *key = keymap_lookup(
+                keymap, shift_active, capslock_active, true, input_bytes[i]);
+            if (key->len != 0) {
+                send_key(config, key);
+                continue;
+            }
+        }
+
+        switch (input_bytes[i]) {
+            case SCANCODE_NUMLOCK:
+                //numlock_active = true;
+                continue;
+            case SCANCODE_ALT_LEFT:
+                alt_active = true;
+                continue;
+            case SCANCODE_ALT_LEFT_REL:
+                alt_active = false;
+                continue;
+            case SCANCODE_SHIFT_LEFT:
+            case SCANCODE_SHIFT_RIGHT:
+                shift_active = true;
+                continue;
+            case SCANCODE_SHIFT_LEFT_REL:
+            case SCANCODE_SHIFT_RIGHT_REL:
+                shift_active = false;
+                continue;
+            case SCANCODE_CTRL:
+                ctrl_active = true;
+                continue;
+            case SCANCODE_CTRL_REL:
+                ctrl_active = false;
+                continue;
+            case SCANCODE_CAPSLOCK:
+                capslock_active = !capslock_active;
+                continue;
+        }
+
+        if (alt_active) {
+           //  F1-F12, as many of them as there are ttys.
+           int f_index = 0;
+           while (f_index < tty_count && tty_scancodes[f_index] != input_bytes[i]) {
+              f_index++;
+           }
+           if (f_index == tty_count) {
+              continue;
+           }
+
+           if (f_index != current_tty) {
+              flush_input_batch();
+              do_tty_switch(f_index);
+              config = input_termios();
+           }
+           continue;
+        } else if (input_bytes[i] >= KEYMAP_SCANCODES) {
+            continue;
+        }
+
+        const struct keymap_entry *key = keymap_lookup(
+            keymap, shift_active, capslock_active, false, input_bytes[i]);
+        if (key->len == 0) {
+            continue;
+        }
+
+        if (ctrl_active && key->len == 1) {
+            char c = toupper(key->bytes[0]) - 0x40;
+            add_to_buf(config, &c, 1, true);
+            continue;
+        }
+
+        send_key(config, key);
+    }
+
+    flush_input_batch();
+}
+
 static noreturn void *kb_input_thread(void *arg) {
     (void)arg;
 
-    struct termios config;
-    bool extra_scancodes = false;
-    bool ctrl_active = false;
-    //bool numlock_active = false;
-    bool alt_active = false;
-    bool shift_active = false;
-    bool capslock_active = false;
+    for (;;) {
+        handle_kb_input();
+        check_signals();
+    }
+}
+
+// Nanoseconds a hidden tty has to wait before it may parse more, refilling
+// its budget on the way. The foreground never waits. Only the thread that
+// reads the tty's master touches its budget.
+static uint64_t budget_wait(int tty_idx, uint64_t now) {
+    struct tty_info *tty = &ttys[tty_idx];
+    if (background_rate == 0 || tty_idx == __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    uint64_t elapsed = now - tty->budget_ns;
+    if (elapsed > 1000000000) {
+        elapsed = 1000000000;
+    }
+    uint64_t burst = background_rate / 10 > HIDDEN_WRITE_SLICE ? background_rate / 10 : HIDDEN_WRITE_SLICE;
+    tty->budget += elapsed * background_rate / 1000000000;
+    if (tty->budget > burst) {
+        tty->budget = burst;
+    }
+    tty->budget_ns = now;
+
+    if (tty->budget >= HIDDEN_WRITE_SLICE) {
+        return 0;
+    }
+    return (HIDDEN_WRITE_SLICE - tty->budget) * 1000000000 / background_rate;
+}
+
+// Hidden ttys wait for budget and output with only CPU time nothing else
+// wants, where that is supported. They get normal priority back before
+// taking their lock, as the foreground may need it. That can take
+// privileges, so it is only done if a throwaway thread manages it first.
+static bool idle_waits = false;
+
+#ifdef SCHED_IDLE
+static void *probe_idle_waits(void *arg) {
+    (void)arg;
+    struct sched_param param = {0};
+    idle_waits = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0 &&
+                 pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) == 0;
+    return NULL;
+}
+#endif
+
+static void probe_background_priority(void) {
+#ifdef SCHED_IDLE
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, probe_idle_waits, NULL) == 0) {
+        pthread_join(thread, NULL);
+    }
+#endif
+}
+
+static void set_background_priority(bool background) {
+#ifdef SCHED_IDLE
+    if (idle_waits) {
+        struct sched_param param = {0};
+        pthread_setschedparam(pthread_self(), background ? SCHED_IDLE : SCHED_OTHER, &param);
+    }
+#else
+    (void)background;
+#endif
+}
+
+// Returns whether the tty is still there, it is let go of once its master
+// hangs up.
+static bool handle_master_input(int tty_idx) {
+    struct tty_info *tty = &ttys[tty_idx];
+    bool hidden = tty_idx != __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE);
+    bool bulk = hidden || tty->bulk;
+    size_t size = bulk ? HIDDEN_READ_SIZE : MASTER_READ_SIZE;
+    if (hidden && background_rate != 0 && tty->budget < size) {
+        // It may have just been hidden with no budget left.
+        if (tty->budget == 0) {
+            return true;
+        }
+        size = tty->budget;
+    }
+
+    ssize_t count = read(tty->master_pty, tty->read_buffer, size);
+
+    // Bulk output takes along whatever else is there already, for jump
+    // scrolling to have more lines to skip.
+    if (count > 0 && bulk && jump_scrolling) {
+        struct pollfd pfd = { .fd = tty->master_pty, .events = POLLIN };
+        while ((size_t)count < size && poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN)) {
+            ssize_t more = read(tty->master_pty, tty->read_buffer + count, size - count);
+            if (more <= 0) {
+                break;
+            }
+            count += more;
+        }
+    }
+
+    // A short read most likely left nothing behind, so the next one waits
+    // for output first. Full ones go straight on to read again.
+    tty->drained = count < (ssize_t)size;
+
+    if (count > 0) {
+        TRACE_INSTANT(TRACE_MASTER_READ, tty_idx);
+        record_output(tty_idx, tty->read_buffer, count);
+        __atomic_add_fetch(&tty->bytes_read, count, __ATOMIC_RELAXED);
+
+        // The foreground reads in bulk for as long as reads come back full.
+        if (!hidden) {
+            tty->bulk = jump_scrolling && (size_t)count >= MASTER_READ_SIZE;
+        } else if (background_rate != 0) {
+            tty->budget -= (size_t)count < tty->budget ? (size_t)count : tty->budget;
+        }
+
+        ssize_t off = jump_scroll(tty_idx, tty->read_buffer, count);
+        if (!hidden && count - off <= MASTER_READ_SIZE) {
+            locked_term_write(tty_idx, tty->read_buffer + off, count - off);
+            return true;
+        }
+        for (; off < count; off += HIDDEN_WRITE_SLICE) {
+            size_t len = count - off < HIDDEN_WRITE_SLICE ? count - off : HIDDEN_WRITE_SLICE;
+            locked_term_write(tty_idx, tty->read_buffer + off, len);
+        }
+    } else if (count == 0 || errno == EIO) {
+        if (exit_with_session && tty_idx == 0) {
+            finish(0);
+        }
+        return tty_hangup(tty_idx);
+    }
+    return true;
+}
+
+// Changes whenever any tty prints, for the supervisor to tell idle time by.
+static uint64_t output_activity(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < tty_count; i++) {
+        total += __atomic_load_n(&ttys[i].bytes_read, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Reads a tty's master for as long as the tty is there.
+static void *master_input_thread(void *arg) {
+    int tty_idx = (intptr_t)arg;
+    for (;;) {
+        bool hidden = tty_idx != __atomic_load_n(&current_tty, __ATOMIC_ACQUIRE);
+        uint64_t wait = budget_wait(tty_idx, now_ns());
+        bool waiting = wait != 0 || ttys[tty_idx].drained;
+        if (hidden && waiting) {
+            set_background_priority(true);
+        }
+
+        // Wait in short steps, so becoming the foreground ends the wait.
+        bool ready = true;
+        if (wait != 0) {
+            struct timespec ts = {
+                .tv_sec  = 0,
+                .tv_nsec = wait < BUDGET_RECHECK_NS ? wait : BUDGET_RECHECK_NS
+            };
+            nanosleep(&ts, NULL);
+            ready = false;
+        } else if (ttys[tty_idx].drained) {
+            struct pollfd pfd = { .fd = ttys[tty_idx].master_pty, .events = POLLIN };
+            ready = poll(&pfd, 1, -1) != -1;
+        }
+
+        if (hidden && waiting) {
+            set_background_priority(false);
+        }
+        if (ready && !handle_master_input(tty_idx)) {
+            return NULL;
+        }
+    }
+}
+
+// Single-threaded alternative to the input threads, one poll() watches the
+// keyboard and every master, and dispatches both from the same loop.
+static noreturn void event_loop(void) {
+    // The signal pipe goes after the masters.
+    struct pollfd fds[MAX_TTYS + 2];
+    fds[0].fd = kb;
+    fds[0].events = POLLIN;
+    bool dead[MAX_TTYS] = {false};
+    for (int i = 0; i < tty_count; i++) {
+        fds[i + 1].events = POLLIN;
+    }
+    if (pipe(signal_pipe) == -1) {
+        perror("Could not create signal pipe");
+        signal_pipe[0] = signal_pipe[1] = -1;
+    }
+    for (int i = 0; i < 2 && signal_pipe[i] != -1; i++) {
+        fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    fds[tty_count + 1].fd = signal_pipe[0];
+    fds[tty_count + 1].events = POLLIN;
+
+    // Anything that came before the pipe was there.
+    check_signals();
 
     for (;;) {
-        uint8_t input_bytes[5];
-        ssize_t count = read(kb, &input_bytes, 5);
-        if (tcgetattr(ttys[current_tty].master_pty, &config) < 0) {
-            perror("Could not fetch termios in keyboard input thread");
+        int timeout = -1;
+        uint64_t now = now_ns();
+        if (__atomic_load_n(&flush_pending, __ATOMIC_ACQUIRE)) {
+            timeout = next_flush_ns > now ? (next_flush_ns - now + 999999) / 1000000 : 0;
         }
 
-        for (ssize_t i = 0; i < count; i++) {
-            if (input_bytes[i] == 0xe0) {
-                extra_scancodes = true;
+        // Hidden ttys out of budget are left alone until they have some.
+        // Those not created are left alone too, and get a new master when
+        // they are.
+        for (int i = 0; i < tty_count; i++) {
+            if (!__atomic_load_n(&ttys[i].created, __ATOMIC_ACQUIRE)) {
+                dead[i] = false;
+                fds[i + 1].fd = -1;
                 continue;
             }
-
-            if (extra_scancodes == true) {
-                extra_scancodes = false;
-
-                switch (input_bytes[i]) {
-                    case SCANCODE_CTRL:
-                        ctrl_active = true;
-                        continue;
-                    case SCANCODE_CTRL_REL:
-                    ctrl_active = false;
-                        continue;
-                    case 0x1c:
-                        add_to_buf(&config, "\n", 1, true);
-                        continue;
-                    case 0x35:
-                        add_to_buf(&config, "/", 1, true);
-                        continue;
-                    case 0x48: // up arrow
-                        if (decckm == false) {
-                            add_to_buf(&config, "\e[A", 3, true);
-                        } else {
-                            add_to_buf(&config, "\eOA", 3, true);
-                        }
-                        continue;
-                    case 0x4b: // left arrow
-                        if (decckm == false) {
-                            add_to_buf(&config, "\e[D", 3, true);
-                        } else {
-                            add_to_buf(&config, "\eOD", 3, true);
-                        }
-                        continue;
-                    case 0x50: // down arrow
-                        if (decckm == false) {
-                            add_to_buf(&config, "\e[B", 3, true);
-                        } else {
-                            add_to_buf(&config, "\eOB", 3, true);
-                        }
-                        continue;
-                    case 0x4d: // right arrow
-                        if (decckm == false) {
-                            add_to_buf(&config, "\e[C", 3, true);
-                        } else {
-                            add_to_buf(&config, "\eOC", 3, true);
-                        }
-                        continue;
-                    case 0x47: // home
-                        add_to_buf(&config, "\e[1~", 4, true);
-                        continue;
-                    case 0x4f: // end
-                        add_to_buf(&config, "\e[4~", 4, true);
-                        continue;
-                    case 0x49: // pgup
-                        add_to_buf(&config, "\e[5~", 4, true);
-                        continue;
-                    case 0x51: // pgdown
-                        add_to_buf(&config, "\e[6~", 4, true);
-                        continue;
-                    case 0x53: // delete
-                        add_to_buf(&config, "\e[3~", 4, true);
-                        continue;
-                }
+            uint64_t wait = dead[i] ? 0 : budget_wait(i, now);
+            fds[i + 1].fd = dead[i] || wait != 0 ? -1 : ttys[i].master_pty;
+            int wait_ms = (wait + 999999) / 1000000;
+            if (wait != 0 && (timeout == -1 || wait_ms < timeout)) {
+                timeout = wait_ms;
             }
+        }
 
-            switch (input_bytes[i]) {
-                case SCANCODE_NUMLOCK:
-                    //numlock_active = true;
-                    continue;
-                case SCANCODE_ALT_LEFT:
-                    alt_active = true;
-                    continue;
-                case SCANCODE_ALT_LEFT_REL:
-                    alt_active = false;
-                    continue;
-                case SCANCODE_SHIFT_LEFT:
-                case SCANCODE_SHIFT_RIGHT:
-                    shift_active = true;
-                    continue;
-                case SCANCODE_SHIFT_LEFT_REL:
-                case SCANCODE_SHIFT_RIGHT_REL:
-                    shift_active = false;
-                    continue;
-                case SCANCODE_CTRL:
-                    ctrl_active = true;
-                    continue;
-                case SCANCODE_CTRL_REL:
-                    ctrl_active = false;
-                    continue;
-                case SCANCODE_CAPSLOCK:
-                    capslock_active = !capslock_active;
-                    continue;
+        if (poll(fds, tty_count + 2, timeout) == -1) {
+            if (errno != EINTR) {
+                perror("Could not poll input");
             }
+            check_signals();
+            continue;
+        }
+        if (fds[tty_count + 1].revents & POLLIN) {
+            char drain[64];
+            while (read(signal_pipe[0], drain, sizeof(drain)) > 0);
+            check_signals();
+        }
 
-            char c = 0;
-
-            if (alt_active) {
-               //  F1-F8 are consecutive from 0x3B to 0x42, those are the
-               //  8 virtual terminals we will support.
-               if (input_bytes[i] < 0x3B || input_bytes[i] > 0x42) {
-                  continue;
-               }
-
-               int f_index = input_bytes[i] - 0x3B;
-               if (f_index != current_tty) {
-                  do_tty_switch(f_index);
-               }
-               continue;
-            } else if (input_bytes[i] < SCANCODE_MAX) {
-                if (capslock_active == false && shift_active == false) {
-                    c = convtab_nomod[input_bytes[i]];
-                }
-                    if (capslock_active == false && shift_active == true) {
-                    c = convtab_shift[input_bytes[i]];
+        // Keyboard first, so echo is not queued behind bulk output.
+        for (int i = 0; i < tty_count + 1; i++) {
+            if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                fds[i].fd = -1;
+                if (i != 0) {
+                    dead[i - 1] = true;
                 }
-                if (capslock_active == true && shift_active == false) {
-                    c = convtab_capslock[input_bytes[i]];
-                }
-                if (capslock_active == true && shift_active == true) {
-                    c = convtab_shift_capslock[input_bytes[i]];
+            } else if (fds[i].revents & (POLLIN | POLLHUP)) {
+                if (i == 0) {
+                    handle_kb_input();
+                } else {
+                    handle_master_input(i - 1);
                 }
-            } else {
-                continue;
-            }
-
-            if (ctrl_active) {
-                c = toupper(c) - 0x40;
             }
+        }
 
-            add_to_buf(&config, &c, 1, true);
+        if (__atomic_load_n(&flush_pending, __ATOMIC_ACQUIRE) && now_ns() >= next_flush_ns) {
+            flush_foreground();
         }
     }
 }
 
-static noreturn void *master_input_thread(void *arg) {
-    int tty_idx = (int)arg;
-    char output[512];
-    for (;;) {
-        ssize_t count = read(ttys[tty_idx].master_pty, output, 512);
-        if (count != 0) {
-            locked_term_write(tty_idx, output, count);
+// Push a recording through the terminals as if it came from their masters,
+// with no sessions behind them, and report how long drawing it took along
+// with a checksum of the final frame.
+static noreturn void replay_recording(struct replay *replay, bool real_time) {
+    struct record_event event;
+    uint64_t bytes = 0;
+    uint64_t start = now_ns();
+    int status;
+    while ((status = replay_next(replay, &event)) == 1) {
+        if (event.tty >= tty_count) {
+            status = -1;
+            break;
+        }
+        if (real_time) {
+            uint64_t at = start + event.time_ns;
+            struct timespec deadline = {
+                .tv_sec  = at / 1000000000,
+                .tv_nsec = at % 1000000000
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+                check_signals();
+            }
+        }
+
+        if (event.type == RECORD_TTY_SWITCH) {
+            if (event.tty != current_tty) {
+                do_tty_switch(event.tty);
+            }
+        } else if (!ensure_tty(event.tty)) {
+            perror("Could not create tty");
+        } else {
+            size_t skip = jump_scroll(event.tty, event.data, event.len);
+            locked_term_write(event.tty, event.data + skip, event.len - skip);
+            bytes += event.len;
         }
+        check_signals();
+    }
+    if (status == -1) {
+        fprintf(stderr, "Recording is corrupt, stopped replaying early\n");
     }
+
+    flush_foreground();
+    uint64_t elapsed = now_ns() - start;
+    pthread_mutex_lock(&fb_lock);
+    uint64_t checksum = fb_checksum();
+    pthread_mutex_unlock(&fb_lock);
+    printf("replay.bytes %llu\n", (unsigned long long)bytes);
+    printf("replay.ns %llu\n", (unsigned long long)elapsed);
+    printf("replay.mb_s %.2f\n", elapsed ? bytes * 1e3 / elapsed : 0);
+    printf("replay.checksum %016llx\n", (unsigned long long)checksum);
+    fflush(stdout);
+    finish(status == -1);
+}
+
+static bool pan_display(size_t yoffset) {
+    pan_info.xoffset = 0;
+    pan_info.yoffset = yoffset;
+    return ioctl(fb, FBIOPAN_DISPLAY, &pan_info) != -1;
+}
+
+// Plain memory shows nothing, any page will do.
+static bool pan_emulated(size_t yoffset) {
+    (void)yoffset;
+    return true;
 }
 
-static void free_with_size(void *ptr, size_t s) {
-    (void)s;
-    free(ptr);
+static noreturn void usage(const char *name, int status) {
+    fprintf(status ? stderr : stdout,
+        "Usage: %s [options]\n"
+        "  -e      Use a single poll() event loop instead of input threads\n"
+        "  -r hz   Cap foreground refreshes per second, 0 to flush after\n"
+        "          every write (default 60)\n"
+        "  -m MiB  Memory for per-tty snapshots that make switching to\n"
+        "          them instant (default 0)\n"
+        "  -l n    Lines of scrollback per tty, 0 to disable (default 1000)\n"
+        "  -K file Compiled keymap to use instead of the builtin US one\n"
+        "  -n n    Number of ttys, switched to with Alt and F1 to F12. Each\n"
+        "          is only created once switched to (default 8, at most 12)\n"
+        "  -p list Comma separated ttys (0-11) whose input is written to the\n"
+        "          PTY untouched, leaving line editing and echo to the kernel\n"
+#ifdef GCON_TRACE
+        "  -t file Where SIGUSR1 writes the latency trace, in Chrome trace\n"
+        "          event format\n"
+#endif
+        "  -f file Framebuffer device (default /dev/fb0)\n"
+        "  -k file Keyboard device (default /dev/ps2keyboard)\n"
+        "  -b file PC speaker device (default /dev/pcspeaker)\n"
+        "  -g WxH[xBPP]\n"
+        "          Treat the framebuffer as plain memory with room for three\n"
+        "          pages of this size and depth (16, 24 or 32, default 32)\n"
+        "          instead of querying it, for running without a real one\n"
+        "  -s      Draw straight to the shown framebuffer page instead of\n"
+        "          flipping between two when the device has room for them\n"
+        "  -y      Scroll by panning over the framebuffer's virtual height\n"
+        "          instead of flipping, redrawing only the lines that come\n"
+        "          into view, if it has room for three pages\n"
+        "  -c cmd  Run cmd with /bin/sh instead of login on each tty\n"
+        "  -x      Exit once the session on the first tty exits\n"
+        "  -a      Start the sessions of every tty while idle, instead of\n"
+        "          on the first switch to each\n"
+        "  -o file Write statistics to file on exit\n"
+        "  -j      Draw every line of output, instead of skipping plain text\n"
+        "          that scrolls off before a frame could show it\n"
+        "  -B KiB  Output per second hidden ttys may process, 0 for no\n"
+        "          limit (default 2048)\n"
+        "  -R file Record what every tty's session prints to file\n"
+        "  -P file Replay a recording without starting any session, then\n"
+        "          print how long it took and a checksum of the screen\n"
+        "  -T      Replay at the recorded pace instead of at full speed\n"
+        "  -h      Print this help and exit\n"
+        "Sending SIGUSR1 dumps statistics to stderr, SIGTERM exits.\n",
+        name);
+    exit(status);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+    start_ns = now_ns();
+    bool use_event_loop = false;
+    int opt;
+    const char *keymap_path = NULL;
+    const char *fb_path = "/dev/fb0";
+    const char *kb_path = "/dev/ps2keyboard";
+    const char *pcspkr_path = "/dev/pcspeaker";
+    unsigned int fake_width = 0;
+    unsigned int fake_height = 0;
+    unsigned int fake_bpp = 32;
+    bool single_buffer = false;
+    bool pan_scrolling = false;
+    bool prestart_sessions = false;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    bool replay_real_time = false;
+    while ((opt = getopt(argc, argv, "er:m:l:K:n:p:t:f:k:b:g:syc:xao:R:P:TjB:h")) != -1) {
+        switch (opt) {
+            case 'e': use_event_loop = true; break;
+            case 'r': {
+                int hz = atoi(optarg);
+                flush_period_ns = hz > 0 ? 1000000000 / hz : 0;
+                break;
+            }
+            case 'm': snapshot_budget = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'l': scrollback_limit = strtoull(optarg, NULL, 10); break;
+            case 'K': keymap_path = optarg; break;
+            case 'n':
+                tty_count = atoi(optarg);
+                if (tty_count < 1 || tty_count > MAX_TTYS) {
+                    usage(argv[0], 1);
+                }
+                break;
+            case 'p':
+                for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                    int idx = atoi(tok);
+                    if (idx < 0 || idx >= MAX_TTYS) {
+                        usage(argv[0], 1);
+                    }
+                    ttys[idx].passthrough = true;
+                }
+                break;
+#ifdef GCON_TRACE
+            case 't': trace_path = optarg; break;
+#endif
+            case 'f': fb_path = optarg; break;
+            case 'k': kb_path = optarg; break;
+            case 'b': pcspkr_path = optarg; break;
+            case 'g':
+                if (sscanf(optarg, "%ux%ux%u", &fake_width, &fake_height, &fake_bpp) < 2 ||
+                    fake_width == 0 || fake_height == 0 ||
+                    (fake_bpp != 16 && fake_bpp != 24 && fake_bpp != 32)) {
+                    usage(argv[0], 1);
+                }
+                break;
+            case 's': single_buffer = true; break;
+            case 'y': pan_scrolling = true; break;
+            case 'c':
+                command_args[2] = optarg;
+                session_args = command_args;
+                break;
+            case 'x': exit_with_session = true; break;
+            case 'a': prestart_sessions = true; break;
+            case 'o': stats_path = optarg; break;
+            case 'R': record_path = optarg; break;
+            case 'P': replay_path = optarg; break;
+            case 'T': replay_real_time = true; break;
+            case 'j': jump_scrolling = false; break;
+            case 'B': background_rate = strtoull(optarg, NULL, 10) * 1024; break;
+            case 'h': usage(argv[0], 0);
+            default:  usage(argv[0], 1);
+        }
+    }
+
     // Initialize the tty.
     struct fb_var_screeninfo var_info;
     struct fb_fix_screeninfo fix_info;
-    int fb = open("/dev/fb0", O_RDWR);
+    fb = open(fb_path, O_RDWR);
     if (fb == -1) {
         perror("Could not open framebuffer");
         return 1;
     }
 
+    if (keymap_path != NULL) {
+        keymap = keymap_load(keymap_path);
+        if (keymap == NULL) {
+            perror("Could not load keymap");
+            return 1;
+        }
+    } else {
+        keymap = keymap_builtin();
+    }
+
     // Export some variables related to the TTY.
     putenv("TERM=linux");
 
     // Open devices.
-    pcspkr = open("/dev/pcspeaker", O_RDWR);
-    kb = open("/dev/ps2keyboard", O_RDONLY);
-    if (kb == -1) {
-        perror("Could not open keyboard");
-        return 1;
+    pcspkr = open(pcspkr_path, O_RDWR);
+    struct replay replay;
+    if (replay_path != NULL) {
+        // Replays take no input.
+        if (!replay_open(&replay, replay_path)) {
+            perror("Could not open recording");
+            return 1;
+        }
+        kb = -1;
+    } else {
+        kb = open(kb_path, O_RDONLY);
+        if (kb == -1) {
+            perror("Could not open keyboard");
+            return 1;
+        }
     }
 
-    if (ioctl(fb, FBIOGET_VSCREENINFO, &var_info) == -1) {
-        perror("Could not fetch framebuffer properties");
-        return 1;
+    if (fake_width != 0) {
+        memset(&var_info, 0, sizeof(var_info));
+        memset(&fix_info, 0, sizeof(fix_info));
+        var_info.xres = var_info.xres_virtual = fake_width;
+        var_info.yres = fake_height;
+        var_info.yres_virtual = fake_height * 3;
+        var_info.bits_per_pixel = fake_bpp;
+        if (fake_bpp == 16) {
+            var_info.red   = (struct fb_bitfield){ .offset = 11, .length = 5 };
+            var_info.green = (struct fb_bitfield){ .offset = 5,  .length = 6 };
+            var_info.blue  = (struct fb_bitfield){ .offset = 0,  .length = 5 };
+        } else {
+            var_info.red   = (struct fb_bitfield){ .offset = 16, .length = 8 };
+            var_info.green = (struct fb_bitfield){ .offset = 8,  .length = 8 };
+            var_info.blue  = (struct fb_bitfield){ .offset = 0,  .length = 8 };
+        }
+        fix_info.line_length = fake_width * (fake_bpp / 8);
+        fix_info.ypanstep = 1;
+        fix_info.smem_len = fix_info.line_length * var_info.yres_virtual;
+    } else {
+        if (ioctl(fb, FBIOGET_VSCREENINFO, &var_info) == -1) {
+            perror("Could not fetch framebuffer properties");
+            return 1;
+        }
+        if (ioctl(fb, FBIOGET_FSCREENINFO, &fix_info) == -1) {
+            perror("Could not fetch framebuffer properties");
+            return 1;
+        }
     }
-    if (ioctl(fb, FBIOGET_FSCREENINFO, &fix_info) == -1) {
-        perror("Could not fetch framebuffer properties");
+
+    struct fb_format format = {
+        .bits_per_pixel = var_info.bits_per_pixel,
+        .red_offset     = var_info.red.offset,
+        .red_length     = var_info.red.length,
+        .green_offset   = var_info.green.offset,
+        .green_length   = var_info.green.length,
+        .blue_offset    = var_info.blue.offset,
+        .blue_length    = var_info.blue.length
+    };
+    if (!fb_format_supported(&format)) {
+        fprintf(stderr, "Unsupported framebuffer format, %u bits per pixel\n",
+            var_info.bits_per_pixel);
         return 1;
     }
 
-    size_t pixel_size  = fix_info.smem_len / sizeof(uint32_t);
-    size_t linear_size = pixel_size * sizeof(uint32_t);
-    size_t aligned_size = (linear_size + 0x1000 - 1) & ~(0x1000 - 1);
-    uint32_t *mem_window = mmap(
+    // Some drivers leave the pitch out, rows are packed then.
+    size_t pitch = fix_info.line_length;
+    if (pitch == 0) {
+        pitch = var_info.xres_virtual * (var_info.bits_per_pixel / 8);
+    }
+
+    size_t aligned_size = (fix_info.smem_len + 0x1000 - 1) & ~(0x1000 - 1);
+    void *mem_window = mmap(
         NULL,
         aligned_size,
         PROT_READ | PROT_WRITE,
@@ -447,77 +1747,148 @@ int main(void) {
         fb,
         0
     );
-    if (mem_window == NULL) {
+    if (mem_window == MAP_FAILED) {
         perror("Could not mmap framebuffer");
         return 1;
     }
 
-    // Common termios for all terminals.
-    struct termios termios;
-    termios.c_iflag = BRKINT | IGNPAR | ICRNL | IXON | IMAXBEL;
-    termios.c_oflag = OPOST | ONLCR;
-    termios.c_cflag = CS8 | CREAD;
-    termios.c_lflag = ISIG | ICANON | ECHO | ECHOE | ECHOK | ECHOCTL | ECHOKE;
-    termios.c_cc[VINTR] = CTRL('C');
-    termios.c_cc[VEOF] = CTRL('D');
-    termios.c_cc[VSUSP] = CTRL('Z');
-    termios.ibaud = 38400;
-    termios.obaud = 38400;
-
-    struct winsize win_size = {
+    if (replay_path != NULL && (replay.width != var_info.xres || replay.height != var_info.yres)) {
+        fprintf(stderr, "Recording was made at %ux%u, replaying at %ux%u\n",
+            replay.width, replay.height, var_info.xres, var_info.yres);
+    }
+    if (record_path != NULL && !record_open(record_path, var_info.xres, var_info.yres)) {
+        perror("Could not create recording");
+        return 1;
+    }
+
+    // Contexts draw to a shadow copy in RAM, which is then presented.
+    blit_init();
+    uint32_t *shadow = fb_init(
+        mem_window,
+        var_info.xres,
+        var_info.yres,
+        pitch,
+        &format
+    );
+    if (shadow == NULL) {
+        perror("Could not allocate shadow framebuffer");
+        return 1;
+    }
+
+    // Flip between two pages to never show a frame half drawn, or scroll by
+    // panning over three or more if asked to, if there is room and the
+    // device can pan. Either way start at the top.
+    pan_info = var_info;
+    bool (*pan)(size_t) = fake_width != 0 ? pan_emulated : pan_display;
+    bool can_pan = pan(0) && fix_info.ypanstep != 0 && var_info.yres % fix_info.ypanstep == 0;
+    size_t pan_lines = var_info.yres_virtual;
+    if (fix_info.smem_len / pitch < pan_lines) {
+        pan_lines = fix_info.smem_len / pitch;
+    }
+    if (!single_buffer && can_pan && pan_lines >= var_info.yres * 2) {
+        if (pan_scrolling && pan_lines >= var_info.yres * 3 &&
+            FONT_HEIGHT % fix_info.ypanstep == 0) {
+            if (!fb_enable_scrolling(pan, pan_lines, FONT_HEIGHT)) {
+                perror("Could not allocate scrolling state");
+                return 1;
+            }
+        } else if (!fb_enable_flipping(pan)) {
+            perror("Could not allocate page flipping state");
+            return 1;
+        }
+    }
+
+    init_pty_termios();
+
+    pty_size = (struct winsize){
         .ws_row = var_info.yres / FONT_HEIGHT,
         .ws_col = var_info.xres / FONT_WIDTH,
         .ws_xpixel = var_info.xres,
         .ws_ypixel = var_info.yres
     };
 
-    // Initialize the terminals.
-    for (int i = 0; i < 8; i++) {
-        ttys[i].context = flanterm_fb_init(
-            malloc,
-            free_with_size,
-            mem_window,
-            var_info.xres,
-            var_info.yres,
-            fix_info.smem_len / var_info.yres,
-            8, 16, 8, 8, 8, 0,
-            NULL,
-            NULL, NULL,
-            NULL, NULL,
-            NULL, NULL,
-            unifont_arr, FONT_WIDTH, FONT_HEIGHT, 0,
-            1, 1,
-            0
-        );
-        flanterm_set_callback(ttys[i].context, flanterm_callback);
-        flanterm_set_autoflush(ttys[i].context, false);
-        ttys[i].has_init_program = 0;
-
-        // Free the mutex.
-        __atomic_clear(&tty_mutex, __ATOMIC_SEQ_CST);
+    // The terminals themselves are created on the first switch to each.
+    fb_width   = var_info.xres;
+    fb_height  = var_info.yres;
+    term_x_off = (var_info.xres % FONT_WIDTH) / 2;
+    term_y_off = (var_info.yres % FONT_HEIGHT) / 2;
+    frame_size = var_info.xres * var_info.yres * sizeof(uint32_t);
+    shared_shadow = shadow;
+    for (int i = 0; i < tty_count; i++) {
+        pthread_mutex_init(&ttys[i].lock, NULL);
+    }
 
-       if (openpty(&(ttys[i].master_pty), &(ttys[i].slave_pty), NULL, &termios, &win_size) == -1) {
-           perror("Could not create pty");
-           return 1;
-       }
+    // Replays have no sessions behind them. Only login is started again
+    // when it exits, commands run once per switch to a tty without one.
+    // Either way hidden ttys are let go of when their session exits.
+    has_sessions = replay_path == NULL;
+    if (has_sessions) {
+        struct session_config config = {
+            .args       = session_args,
+            .respawn    = session_args == login_args,
+            .prestart   = prestart_sessions,
+            .activity   = output_activity,
+            .create     = ensure_tty,
+            .releasable = tty_releasable
+        };
+        if (!session_init(tty_count, &config)) {
+            perror("Could not set up sessions");
+            return 1;
+        }
     }
 
+    // SIGUSR1 dumps statistics and SIGTERM exits. They are only left
+    // unblocked on the main thread, where they interrupt the blocking
+    // keyboard read or poll.
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // One thread per tty catches what its master says, unless the event
+    // loop does. Replays have nothing to read.
+    reader_threads = !use_event_loop && replay_path == NULL;
+    if (reader_threads) {
+        probe_background_priority();
+    }
     do_tty_switch(0);
+    if (!ttys[0].created) {
+        return 1;
+    }
 
-    // Boot an input process.
-    pthread_t input_thread;
-    if (pthread_create(&input_thread, NULL, kb_input_thread, NULL)) {
-        perror("Could not create input thread!");
+    if (has_sessions && !session_start_supervisor()) {
+        perror("Could not create session supervisor");
+        return 1;
     }
 
-    // Boot one thread per tty to catch what the master says.
-    for (int i = 0; i < 8; i++) {
-        pthread_t master_thread;
-        if (pthread_create(&master_thread, NULL, master_input_thread, (void *)i)) {
-            perror("Could not create master thread!");
+    if (use_event_loop && replay_path == NULL) {
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+        event_loop();
+    }
+
+    // Paced flushes get their own thread, the event loop uses its timeout.
+    if (flush_period_ns != 0) {
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, flush_thread, NULL)) {
+            perror("Could not create flush thread!");
+            flush_period_ns = 0;
+        } else {
+            flush_thread_running = true;
         }
     }
 
-    for (;;);
+    if (replay_path != NULL) {
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+        replay_recording(&replay, replay_real_time);
+    }
 
+    // The keyboard is handled by the main thread, instead of spinning it.
+    pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+    kb_input_thread(NULL);
 }
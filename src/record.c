@@ -0,0 +1,216 @@
+/*
+    record.c: Recording and replay of terminal output
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <record.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_SIZE (RECORD_MAGIC_SIZE + 8)
+
+// Set under record_lock, but also peeked at without it to skip taking the
+// lock when not recording.
+static FILE *recording = NULL;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_u32(uint8_t *dst, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        dst[i] = value >> (i * 8);
+    }
+}
+
+static uint32_t get_u32(const uint8_t *src) {
+    return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static bool put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        if (putc((value & 0x7f) | 0x80, recording) == EOF) {
+            return false;
+        }
+        value >>= 7;
+    }
+    return putc(value, recording) != EOF;
+}
+
+static bool get_varint(struct replay *replay, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (replay->offset == replay->size) {
+            return false;
+        }
+        uint8_t byte = replay->data[replay->offset++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool record_open(const char *path, uint32_t width, uint32_t height) {
+    recording = fopen(path, "w");
+    if (recording == NULL) {
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+    put_u32(header + RECORD_MAGIC_SIZE, width);
+    put_u32(header + RECORD_MAGIC_SIZE + 4, height);
+    if (fwrite(header, 1, HEADER_SIZE, recording) != HEADER_SIZE) {
+        int saved_errno = errno;
+        fclose(recording);
+        recording = NULL;
+        errno = saved_errno;
+        return false;
+    }
+    last_ns = now_ns();
+    return true;
+}
+
+static void record_event(int tty, bool is_switch, const char *data, size_t len) {
+    pthread_mutex_lock(&record_lock);
+
+    // It may have been closed since it was peeked at.
+    if (recording == NULL) {
+        pthread_mutex_unlock(&record_lock);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    bool ok = put_varint(now - last_ns);
+    last_ns = now;
+    ok = ok && putc(tty | (is_switch ? RECORD_SWITCH : 0), recording) != EOF;
+    if (!is_switch) {
+        ok = ok && put_varint(len) && fwrite(data, 1, len, recording) == len;
+    }
+    if (!ok) {
+        // Say so once and stop, rather than on every event of a full disk.
+        // What was written so far is kept.
+        perror("Could not write recording");
+        fclose(recording);
+        __atomic_store_n(&recording, NULL, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+void record_output(int tty, const char *data, size_t len) {
+    if (__atomic_load_n(&recording, __ATOMIC_RELAXED) != NULL) {
+        record_event(tty, false, data, len);
+    }
+}
+
+void record_switch(int tty) {
+    if (__atomic_load_n(&recording, __ATOMIC_RELAXED) != NULL) {
+        record_event(tty, true, NULL, 0);
+    }
+}
+
+void record_close(void) {
+    pthread_mutex_lock(&record_lock);
+    if (recording != NULL) {
+        if (fclose(recording) != 0) {
+            perror("Could not write recording");
+        }
+        __atomic_store_n(&recording, NULL, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+bool replay_open(struct replay *replay, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    if ((size_t)st.st_size < HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (memcmp(data, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+        munmap(data, st.st_size);
+        errno = EINVAL;
+        return false;
+    }
+
+    replay->data = data;
+    replay->size = st.st_size;
+    replay->offset = HEADER_SIZE;
+    replay->time_ns = 0;
+    replay->width = get_u32(replay->data + RECORD_MAGIC_SIZE);
+    replay->height = get_u32(replay->data + RECORD_MAGIC_SIZE + 4);
+    return true;
+}
+
+int replay_next(struct replay *replay, struct record_event *event) {
+    if (replay->offset == replay->size) {
+        return 0;
+    }
+
+    uint64_t delta;
+    if (!get_varint(replay, &delta) || replay->offset == replay->size) {
+        return -1;
+    }
+    replay->time_ns += delta;
+    uint8_t tty = replay->data[replay->offset++];
+
+    event->time_ns = replay->time_ns;
+    event->tty = tty & ~RECORD_SWITCH;
+    if (tty & RECORD_SWITCH) {
+        event->type = RECORD_TTY_SWITCH;
+        event->data = NULL;
+        event->len = 0;
+        return 1;
+    }
+
+    uint64_t len;
+    if (!get_varint(replay, &len) || len > replay->size - replay->offset) {
+        return -1;
+    }
+    event->type = RECORD_OUTPUT;
+    event->data = (const char *)replay->data + replay->offset;
+    event->len = len;
+    replay->offset += len;
+    return 1;
+}
@@ -0,0 +1,71 @@
+/*
+    record.h: Recording and replay of terminal output
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A recording is RECORD_MAGIC, the framebuffer width and height as 32-bit
+// little endian values, then one event after another: a varint of the
+// nanoseconds since the previous one, a byte with the tty in the low bits
+// and RECORD_SWITCH set for switches, and for output a varint length and
+// the bytes themselves.
+#define RECORD_MAGIC "GCONREC1"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_SWITCH 0x80
+
+enum record_event_type {
+    RECORD_OUTPUT,
+    RECORD_TTY_SWITCH
+};
+
+struct record_event {
+    enum record_event_type type;
+    int tty;
+    uint64_t time_ns;
+    const char *data;
+    size_t len;
+};
+
+// Events can be recorded from any thread, and are stamped in the order
+// they are taken. Returns false with errno set if the file cannot be made.
+bool record_open(const char *path, uint32_t width, uint32_t height);
+void record_output(int tty, const char *data, size_t len);
+void record_switch(int tty);
+void record_close(void);
+
+struct replay {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    uint64_t time_ns;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Map a recording to replay it. Returns false with errno set on failure.
+bool replay_open(struct replay *replay, const char *path);
+
+// Fetch the next event, whose data points into the mapping. Returns 1 for
+// an event, 0 at the end and -1 if the recording is truncated or corrupt.
+int replay_next(struct replay *replay, struct record_event *event);
+
+#endif
@@ -0,0 +1,700 @@
+/*
+    scrollback.c: Per terminal history of output lines
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <scrollback.h>
+#include <blit.h>
+#include <string.h>
+
+#define DEFAULT_FG 7
+#define DEFAULT_BG 0
+#define DEFAULT_ATTR (DEFAULT_FG | (DEFAULT_BG << 4))
+
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+
+enum {
+    STATE_GROUND,
+    STATE_ESC,
+    STATE_ESC_INTERMEDIATE,
+    STATE_CSI,
+    STATE_OSC,
+    STATE_OSC_ESC
+};
+
+bool scrollback_init(struct scrollback *sb, struct arena *arena, size_t limit,
+                     size_t cols, size_t rows) {
+    *sb = (struct scrollback){0};
+    if (limit == 0 || rows == 0) {
+        return false;
+    }
+
+    // The screen lives at the end of the history ring.
+    limit += rows;
+    sb->cells   = arena_alloc(arena, limit * cols * sizeof(uint32_t));
+    sb->lengths = arena_alloc(arena, limit * sizeof(uint16_t));
+    if (sb->cells == NULL || sb->lengths == NULL) {
+        return false;
+    }
+    memset(sb->lengths, 0, limit * sizeof(uint16_t));
+
+    sb->limit = limit;
+    sb->cols  = cols;
+    sb->rows  = rows;
+    sb->head  = rows - 1;
+    sb->fg    = DEFAULT_FG;
+    sb->bg    = DEFAULT_BG;
+    sb->margin_bottom = rows - 1;
+    return true;
+}
+
+static uint8_t current_attr(struct scrollback *sb) {
+    uint8_t fg = sb->fg;
+    uint8_t bg = sb->bg;
+    if (sb->bold && fg < 8) {
+        fg += 8;
+    }
+    if (sb->reverse) {
+        uint8_t tmp = fg;
+        fg = bg;
+        bg = tmp;
+    }
+    return fg | (bg << 4);
+}
+
+// Erased cells take the current background.
+static uint8_t blank_attr(struct scrollback *sb) {
+    return (current_attr(sb) & 0xf0) | DEFAULT_FG;
+}
+
+// Ring index of screen line y.
+static size_t screen_line(struct scrollback *sb, size_t y) {
+    return (sb->head + sb->limit - (sb->rows - 1 - y)) % sb->limit;
+}
+
+// Make the line at idx at least len cells long, padding with blanks.
+static uint32_t *extend_line(struct scrollback *sb, size_t idx, size_t len) {
+    uint32_t *line = sb->cells + idx * sb->cols;
+    for (size_t i = sb->lengths[idx]; i < len; i++) {
+        line[i] = SCROLLBACK_CELL(' ', DEFAULT_ATTR);
+    }
+    if (len > sb->lengths[idx]) {
+        sb->lengths[idx] = len;
+    }
+    return line;
+}
+
+static void erase_cells(struct scrollback *sb, size_t y, size_t from, size_t to) {
+    size_t idx = screen_line(sb, y);
+    uint8_t attr = blank_attr(sb);
+    to = to < sb->cols ? to : sb->cols;
+    if (from >= to) {
+        return;
+    }
+
+    // Lines end where their last cell that is not a default blank does.
+    if (attr == DEFAULT_ATTR && to >= sb->lengths[idx]) {
+        if (from < sb->lengths[idx]) {
+            sb->lengths[idx] = from;
+        }
+        return;
+    }
+    uint32_t *line = extend_line(sb, idx, to);
+    for (size_t i = from; i < to; i++) {
+        line[i] = SCROLLBACK_CELL(' ', attr);
+    }
+}
+
+static void erase_lines(struct scrollback *sb, size_t from, size_t to) {
+    for (size_t y = from; y < to; y++) {
+        erase_cells(sb, y, 0, sb->cols);
+    }
+}
+
+static void copy_line(struct scrollback *sb, size_t dst_y, size_t src_y) {
+    size_t dst = screen_line(sb, dst_y);
+    size_t src = screen_line(sb, src_y);
+    memcpy(sb->cells + dst * sb->cols, sb->cells + src * sb->cols,
+           sb->lengths[src] * sizeof(uint32_t));
+    sb->lengths[dst] = sb->lengths[src];
+}
+
+// Move lines top to bottom, inclusive, up or down by count, blanking those
+// left behind.
+static void scroll_lines(struct scrollback *sb, size_t top, size_t bottom, size_t count, bool up) {
+    size_t height = bottom - top + 1;
+    count = count < height ? count : height;
+    if (up) {
+        for (size_t y = top; y + count <= bottom; y++) {
+            copy_line(sb, y, y + count);
+        }
+        erase_lines(sb, bottom + 1 - count, bottom + 1);
+    } else {
+        for (size_t y = bottom; y >= top + count; y--) {
+            copy_line(sb, y, y - count);
+        }
+        erase_lines(sb, top, top + count);
+    }
+}
+
+static void line_feed(struct scrollback *sb) {
+    if (sb->y != sb->margin_bottom) {
+        if (sb->y < sb->rows - 1) {
+            sb->y++;
+        }
+        return;
+    }
+    if (sb->margin_top != 0 || sb->margin_bottom != sb->rows - 1) {
+        scroll_lines(sb, sb->margin_top, sb->margin_bottom, 1, true);
+        return;
+    }
+
+    // The whole screen scrolls, which moves its top line into history.
+    sb->head = (sb->head + 1) % sb->limit;
+    sb->lengths[sb->head] = 0;
+    erase_cells(sb, sb->rows - 1, 0, sb->cols);
+    if (sb->count < sb->limit - sb->rows) {
+        sb->count++;
+    }
+}
+
+static void reverse_line_feed(struct scrollback *sb) {
+    if (sb->y == sb->margin_top) {
+        scroll_lines(sb, sb->margin_top, sb->margin_bottom, 1, false);
+    } else if (sb->y > 0) {
+        sb->y--;
+    }
+}
+
+static void put_cell(struct scrollback *sb, uint32_t cp) {
+    if (sb->x >= sb->cols) {
+        line_feed(sb);
+        sb->x = 0;
+    }
+
+    uint32_t *line = extend_line(sb, screen_line(sb, sb->y), sb->x + 1);
+    line[sb->x++] = SCROLLBACK_CELL(cp, current_attr(sb));
+}
+
+// Store a run of printable ASCII, wrapping as needed, a line at a time.
+static void put_run(struct scrollback *sb, const char *buf, size_t len) {
+    uint32_t attr = (uint32_t)current_attr(sb) << 24;
+    while (len > 0) {
+        if (sb->x >= sb->cols) {
+            line_feed(sb);
+            sb->x = 0;
+        }
+
+        size_t count = sb->cols - sb->x < len ? sb->cols - sb->x : len;
+        uint32_t *line = extend_line(sb, screen_line(sb, sb->y), sb->x + count);
+        for (size_t i = 0; i < count; i++) {
+            line[sb->x + i] = (uint8_t)buf[i] | attr;
+        }
+        buf += count;
+        len -= count;
+        sb->x += count;
+    }
+}
+
+static void sgr(struct scrollback *sb) {
+    if (sb->param_count == 0) {
+        sb->params[sb->param_count++] = 0;
+    }
+
+    for (size_t i = 0; i < sb->param_count; i++) {
+        uint32_t p = sb->params[i];
+        if (p == 0) {
+            sb->fg = DEFAULT_FG;
+            sb->bg = DEFAULT_BG;
+            sb->bold = false;
+            sb->reverse = false;
+        } else if (p == 1) {
+            sb->bold = true;
+        } else if (p == 22) {
+            sb->bold = false;
+        } else if (p == 7) {
+            sb->reverse = true;
+        } else if (p == 27) {
+            sb->reverse = false;
+        } else if (p >= 30 && p <= 37) {
+            sb->fg = p - 30;
+        } else if (p == 39) {
+            sb->fg = DEFAULT_FG;
+        } else if (p >= 40 && p <= 47) {
+            sb->bg = p - 40;
+        } else if (p == 49) {
+            sb->bg = DEFAULT_BG;
+        } else if (p >= 90 && p <= 97) {
+            sb->fg = p - 90 + 8;
+        } else if (p >= 100 && p <= 107) {
+            sb->bg = p - 100 + 8;
+        } else if (p == 38 || p == 48) {
+            // Only palette colours that fit our index are kept.
+            if (i + 2 < sb->param_count && sb->params[i + 1] == 5) {
+                if (sb->params[i + 2] < 16) {
+                    if (p == 38) {
+                        sb->fg = sb->params[i + 2];
+                    } else {
+                        sb->bg = sb->params[i + 2];
+                    }
+                }
+                i += 2;
+            } else if (i + 1 < sb->param_count && sb->params[i + 1] == 2) {
+                i += 4;
+            }
+        }
+    }
+}
+
+// Parameter i, with 0 or a missing one meaning def.
+static size_t param(struct scrollback *sb, size_t i, size_t def) {
+    return i < sb->param_count && sb->params[i] != 0 ? sb->params[i] : def;
+}
+
+static void move_to(struct scrollback *sb, size_t x, size_t y) {
+    sb->x = x < sb->cols ? x : sb->cols - 1;
+    sb->y = y < sb->rows ? y : sb->rows - 1;
+}
+
+static void reset(struct scrollback *sb) {
+    erase_lines(sb, 0, sb->rows);
+    sb->fg = DEFAULT_FG;
+    sb->bg = DEFAULT_BG;
+    sb->bold = false;
+    sb->reverse = false;
+    sb->margin_top = 0;
+    sb->margin_bottom = sb->rows - 1;
+    sb->x = sb->y = 0;
+    sb->saved_x = sb->saved_y = 0;
+}
+
+static void set_modes(struct scrollback *sb, bool set) {
+    for (size_t i = 0; sb->csi_private && i < sb->param_count; i++) {
+        uint32_t p = sb->params[i];
+        if ((p == 47 || p == 1047 || p == 1049) && sb->alt_screen != set) {
+            // The cursor comes back to where it was on the main screen.
+            if (set) {
+                sb->saved_x = sb->x;
+                sb->saved_y = sb->y;
+            } else {
+                sb->x = sb->saved_x;
+                sb->y = sb->saved_y;
+            }
+            sb->alt_screen = set;
+        }
+    }
+}
+
+static void csi_final(struct scrollback *sb, char final) {
+    if (final == 'h' || final == 'l') {
+        set_modes(sb, final == 'h');
+        return;
+    }
+    if (sb->csi_private) {
+        return;
+    }
+    if (final == 'm') {
+        sgr(sb);
+        return;
+    }
+    if (sb->alt_screen) {
+        return;
+    }
+
+    size_t n = param(sb, 0, 1);
+    size_t x = sb->x < sb->cols ? sb->x : sb->cols - 1;
+    switch (final) {
+        case 'A':
+            move_to(sb, x, sb->y > n ? sb->y - n : 0);
+            break;
+        case 'B':
+        case 'e':
+            move_to(sb, x, sb->y + n);
+            break;
+        case 'C':
+        case 'a':
+            move_to(sb, x + n, sb->y);
+            break;
+        case 'D':
+            move_to(sb, x > n ? x - n : 0, sb->y);
+            break;
+        case 'E':
+            move_to(sb, 0, sb->y + n);
+            break;
+        case 'F':
+            move_to(sb, 0, sb->y > n ? sb->y - n : 0);
+            break;
+        case 'G':
+        case '`':
+            move_to(sb, n - 1, sb->y);
+            break;
+        case 'd':
+            move_to(sb, x, n - 1);
+            break;
+        case 'H':
+        case 'f':
+            move_to(sb, param(sb, 1, 1) - 1, n - 1);
+            break;
+        case 'J':
+            switch (param(sb, 0, 0)) {
+                case 0:
+                    erase_cells(sb, sb->y, sb->x, sb->cols);
+                    erase_lines(sb, sb->y + 1, sb->rows);
+                    break;
+                case 1:
+                    erase_lines(sb, 0, sb->y);
+                    erase_cells(sb, sb->y, 0, sb->x + 1);
+                    break;
+                default:
+                    erase_lines(sb, 0, sb->rows);
+                    break;
+            }
+            break;
+        case 'K':
+            switch (param(sb, 0, 0)) {
+                case 0: erase_cells(sb, sb->y, sb->x, sb->cols); break;
+                case 1: erase_cells(sb, sb->y, 0, sb->x + 1);    break;
+                default: erase_cells(sb, sb->y, 0, sb->cols);    break;
+            }
+            break;
+        case 'X':
+            erase_cells(sb, sb->y, x, x + n);
+            break;
+        case 'P':
+        case '@': {
+            // Delete or insert cells, shifting the rest of the line.
+            size_t idx = screen_line(sb, sb->y);
+            if (x >= sb->lengths[idx]) {
+                break;
+            }
+            uint32_t *line = sb->cells + idx * sb->cols;
+            size_t len = sb->lengths[idx];
+            n = n < sb->cols - x ? n : sb->cols - x;
+            if (final == 'P') {
+                size_t kept = len > x + n ? len - x - n : 0;
+                memmove(line + x, line + x + n, kept * sizeof(uint32_t));
+                sb->lengths[idx] = x + kept;
+            } else {
+                size_t kept = len - x < sb->cols - x - n ? len - x : sb->cols - x - n;
+                memmove(line + x + n, line + x, kept * sizeof(uint32_t));
+                for (size_t i = x; i < x + n; i++) {
+                    line[i] = SCROLLBACK_CELL(' ', blank_attr(sb));
+                }
+                sb->lengths[idx] = x + n + kept;
+            }
+            break;
+        }
+        case 'L':
+        case 'M':
+            if (sb->y >= sb->margin_top && sb->y <= sb->margin_bottom) {
+                scroll_lines(sb, sb->y, sb->margin_bottom, n, final == 'M');
+                sb->x = 0;
+            }
+            break;
+        case 'S':
+        case 'T':
+            scroll_lines(sb, sb->margin_top, sb->margin_bottom, n, final == 'S');
+            break;
+        case 'r': {
+            size_t top = param(sb, 0, 1) - 1;
+            size_t bottom = param(sb, 1, sb->rows) - 1;
+            if (top < bottom && bottom < sb->rows) {
+                sb->margin_top = top;
+                sb->margin_bottom = bottom;
+            }
+            move_to(sb, 0, 0);
+            break;
+        }
+        case 's':
+            sb->saved_x = sb->x;
+            sb->saved_y = sb->y;
+            break;
+        case 'u':
+            sb->x = sb->saved_x;
+            sb->y = sb->saved_y;
+            break;
+    }
+}
+
+static void esc_final(struct scrollback *sb, uint8_t c) {
+    if (c == 'c') {
+        sb->alt_screen = false;
+        reset(sb);
+    }
+    if (sb->alt_screen) {
+        return;
+    }
+    switch (c) {
+        case 'D':
+            line_feed(sb);
+            break;
+        case 'E':
+            line_feed(sb);
+            sb->x = 0;
+            break;
+        case 'M':
+            reverse_line_feed(sb);
+            break;
+        case '7':
+            sb->saved_x = sb->x;
+            sb->saved_y = sb->y;
+            break;
+        case '8':
+            sb->x = sb->saved_x;
+            sb->y = sb->saved_y;
+            break;
+    }
+}
+
+void scrollback_feed(struct scrollback *sb, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        // Most output is runs of plain text, which need no parsing at all.
+        // This keeps down what mirroring adds to flanterm, which parses the
+        // same bytes again on its own.
+        if (sb->state == STATE_GROUND) {
+            size_t run = blit->printable_run(buf + i, len - i);
+            if (run != 0) {
+                if (!sb->alt_screen) {
+                    put_run(sb, buf + i, run);
+                }
+                sb->utf8_left = 0;
+                i += run;
+                if (i == len) {
+                    break;
+                }
+            }
+        }
+
+        uint8_t c = buf[i];
+
+        switch (sb->state) {
+            case STATE_ESC:
+                if (c == '[') {
+                    sb->state = STATE_CSI;
+                    sb->csi_private = false;
+                    sb->param_count = 0;
+                } else if (c == ']') {
+                    sb->state = STATE_OSC;
+                } else if (c >= 0x20 && c <= 0x2f) {
+                    // Such as ESC ( B, which selects a character set.
+                    sb->state = STATE_ESC_INTERMEDIATE;
+                } else {
+                    esc_final(sb, c);
+                    sb->state = STATE_GROUND;
+                }
+                continue;
+            case STATE_ESC_INTERMEDIATE:
+                if (c < 0x20 || c > 0x2f) {
+                    sb->state = STATE_GROUND;
+                }
+                continue;
+            case STATE_CSI:
+                if (c >= '0' && c <= '9') {
+                    if (sb->param_count == 0) {
+                        sb->params[sb->param_count++] = 0;
+                    }
+                    uint32_t *p = &sb->params[sb->param_count - 1];
+                    *p = *p * 10 + (c - '0');
+                } else if (c == ';') {
+                    if (sb->param_count == 0) {
+                        sb->params[sb->param_count++] = 0;
+                    }
+                    if (sb->param_count < sizeof(sb->params) / sizeof(sb->params[0])) {
+                        sb->params[sb->param_count++] = 0;
+                    }
+                } else if (c >= 0x3c && c <= 0x3f) {
+                    sb->csi_private = true;
+                } else if (c >= 0x20 && c <= 0x2f) {
+                    // Intermediates, as in ESC [ 2 SP q, mean nothing we do.
+                    sb->csi_private = true;
+                } else if (c >= 0x40 && c <= 0x7e) {
+                    csi_final(sb, c);
+                    sb->state = STATE_GROUND;
+                }
+                continue;
+            case STATE_OSC:
+                if (c == '\a') {
+                    sb->state = STATE_GROUND;
+                } else if (c == '\e') {
+                    sb->state = STATE_OSC_ESC;
+                }
+                continue;
+            case STATE_OSC_ESC:
+                sb->state = c == '\\' ? STATE_GROUND : STATE_OSC;
+                continue;
+        }
+
+        if (c == '\e') {
+            sb->state = STATE_ESC;
+            sb->utf8_left = 0;
+            continue;
+        }
+        if (sb->alt_screen) {
+            continue;
+        }
+
+        if (c >= 0x80) {
+            if ((c & 0xc0) == 0x80 && sb->utf8_left > 0) {
+                sb->utf8_cp = (sb->utf8_cp << 6) | (c & 0x3f);
+                if (--sb->utf8_left == 0) {
+                    put_cell(sb, sb->utf8_cp);
+                }
+            } else if ((c & 0xe0) == 0xc0) {
+                sb->utf8_cp = c & 0x1f;
+                sb->utf8_left = 1;
+            } else if ((c & 0xf0) == 0xe0) {
+                sb->utf8_cp = c & 0x0f;
+                sb->utf8_left = 2;
+            } else if ((c & 0xf8) == 0xf0) {
+                sb->utf8_cp = c & 0x07;
+                sb->utf8_left = 3;
+            }
+            continue;
+        }
+        sb->utf8_left = 0;
+
+        switch (c) {
+            case '\n':
+            case '\v':
+            case '\f':
+                line_feed(sb);
+                break;
+            case '\r':
+                sb->x = 0;
+                break;
+            case '\b':
+                if (sb->x > 0) {
+                    sb->x--;
+                }
+                break;
+            case '\t':
+                sb->x = (sb->x + 8) & ~(size_t)7;
+                if (sb->x > sb->cols) {
+                    sb->x = sb->cols;
+                }
+                break;
+            default:
+                if (c >= 0x20 && c < 0x7f) {
+                    put_cell(sb, c);
+                }
+                break;
+        }
+    }
+}
+
+// Line feeds in the plain text buf starts with, which ends at end. Plain
+// text is printable, tabs, carriage returns and UTF-8, nothing that moves
+// the cursor other than by writing or changes how things are drawn.
+static size_t plain_lines(const char *buf, size_t len, size_t *end) {
+    size_t lines = 0;
+    size_t i = 0;
+    while (i < len) {
+        i += blit->printable_run(buf + i, len - i);
+        if (i == len) {
+            break;
+        }
+        uint8_t c = buf[i];
+        if (c == '\n') {
+            lines++;
+        } else if (c != '\r' && c != '\t' && c < 0x80) {
+            break;
+        }
+        i++;
+    }
+    *end = i;
+    return lines;
+}
+
+size_t scrollback_jump(struct scrollback *sb, const char *buf, size_t len) {
+    // The stream has to be between sequences, and line feeds have to
+    // scroll the whole screen.
+    if (sb->state != STATE_GROUND || sb->utf8_left != 0 || sb->alt_screen || sb->rows < 2 ||
+        sb->margin_top != 0 || sb->margin_bottom != sb->rows - 1) {
+        return 0;
+    }
+
+    // What is skipped needs enough lines to leave the cursor on the last
+    // row wherever it was, and what follows enough to scroll all of it
+    // off. It has to end at the start of a line, too.
+    size_t end;
+    size_t lines = plain_lines(buf, len, &end);
+    size_t needed = sb->rows - 1;
+    if (lines < needed * 2) {
+        return 0;
+    }
+
+    size_t target = lines - needed;
+    size_t seen = 0;
+    size_t cut = 0;
+    for (size_t i = 0; i < end && seen < target; i++) {
+        if (buf[i] == '\n') {
+            seen++;
+            cut = i;
+        }
+    }
+    for (;;) {
+        if (cut > 0 && buf[cut - 1] == '\r') {
+            return cut + 1;
+        }
+        if (--target < needed) {
+            return 0;
+        }
+        do {
+            cut--;
+        } while (buf[cut] != '\n');
+    }
+}
+
+size_t scrollback_lines(struct scrollback *sb) {
+    return sb->count;
+}
+
+static void draw_glyph(uint32_t *dst, size_t pitch, const uint8_t *font, uint32_t cp,
+                       uint32_t fg, uint32_t bg) {
+    const uint8_t *bits = font + (cp < 0x80 ? cp : '?') * GLYPH_HEIGHT;
+    for (size_t y = 0; y < GLYPH_HEIGHT; y++, dst += pitch) {
+        for (size_t x = 0; x < GLYPH_WIDTH; x++) {
+            dst[x] = (bits[y] & (0x80 >> x)) ? fg : bg;
+        }
+    }
+}
+
+void scrollback_render(struct scrollback *sb, size_t view, const uint8_t *font,
+                       uint32_t *pixels, size_t pitch, size_t x_off, size_t y_off,
+                       const uint32_t *palette) {
+    for (size_t r = 0; r < sb->rows; r++) {
+        size_t age = view + (sb->rows - 1 - r);
+        uint32_t *row = pixels + (y_off + r * GLYPH_HEIGHT) * pitch + x_off;
+        size_t len = 0;
+
+        if (age < sb->count + sb->rows) {
+            size_t idx = (sb->head + sb->limit - age) % sb->limit;
+            const uint32_t *line = sb->cells + idx * sb->cols;
+            len = sb->lengths[idx];
+            for (size_t c = 0; c < len; c++) {
+                uint32_t cell = line[c];
+                draw_glyph(row + c * GLYPH_WIDTH, pitch, font, SCROLLBACK_CP(cell),
+                           palette[SCROLLBACK_FG(cell)], palette[SCROLLBACK_BG(cell)]);
+            }
+        }
+
+        for (size_t y = 0; y < GLYPH_HEIGHT; y++) {
+            blit->fill(row + y * pitch + len * GLYPH_WIDTH, palette[DEFAULT_BG],
+                       (sb->cols - len) * GLYPH_WIDTH);
+        }
+    }
+}
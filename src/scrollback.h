@@ -0,0 +1,94 @@
+/*
+    scrollback.h: Per terminal history of output lines
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <arena.h>
+
+// Cells are packed as the codepoint in the low 24 bits and an attribute
+// index on top, the foreground palette index in the low nibble and the
+// background one in the high nibble.
+#define SCROLLBACK_CELL(cp, attr) ((uint32_t)(cp) | ((uint32_t)(attr) << 24))
+#define SCROLLBACK_CP(cell) ((cell) & 0xffffff)
+#define SCROLLBACK_FG(cell) (((cell) >> 24) & 0xf)
+#define SCROLLBACK_BG(cell) ((cell) >> 28)
+
+// flanterm does not expose its grid, so the screen is rebuilt from the
+// output stream with a small parser that follows the cursor, erases,
+// scrolling and colours. Lines only become history when they scroll off the
+// top of the whole screen. The ring holds the screen in its last rows lines,
+// the one at head being the bottom one. Output while the alternate screen is
+// on is not recorded, as that is where full screen programs draw.
+struct scrollback {
+    uint32_t *cells;
+    uint16_t *lengths;
+    size_t limit;
+    size_t cols;
+    size_t rows;
+    size_t head;
+    size_t count;
+    size_t x;
+    size_t y;
+    size_t saved_x;
+    size_t saved_y;
+
+    uint8_t fg;
+    uint8_t bg;
+    bool bold;
+    bool reverse;
+    bool alt_screen;
+    size_t margin_top;
+    size_t margin_bottom;
+
+    int state;
+    bool csi_private;
+    size_t param_count;
+    uint32_t params[16];
+    uint32_t utf8_cp;
+    int utf8_left;
+};
+
+// Set up a screen of rows lines of cols cells and a history of limit lines
+// out of the passed arena.
+bool scrollback_init(struct scrollback *sb, struct arena *arena, size_t limit,
+                     size_t cols, size_t rows);
+
+void scrollback_feed(struct scrollback *sb, const char *buf, size_t len);
+
+// How many bytes at the start of buf are plain text that would scroll off
+// the screen before the rest of buf is done with. Drawing them can be
+// skipped, clearing the screen and moving to its last line instead, which
+// ends up the same. Only looks at buf, which still has to be fed.
+size_t scrollback_jump(struct scrollback *sb, const char *buf, size_t len);
+
+// Number of lines that can be scrolled back over, above the screen.
+size_t scrollback_lines(struct scrollback *sb);
+
+// Draw a screen of history and screen lines, the last one being view lines
+// above the bottom of the screen, to pixels, at cell (0, 0) being x_off and
+// y_off pixels in, pitch in pixels. font is 8x16 codepage 437, one byte per
+// row, of which only ASCII matches Unicode, the rest is drawn as '?'.
+void scrollback_render(struct scrollback *sb, size_t view, const uint8_t *font,
+                       uint32_t *pixels, size_t pitch, size_t x_off, size_t y_off,
+                       const uint32_t *palette);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+    session.c: Supervisor of the sessions running on each tty
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <session.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdnoreturn.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Sessions that exit sooner than this after starting count as failing to,
+// and every one in a row doubles the wait before the next start.
+#define SHORT_LIVED_NS 5000000000ULL
+#define BACKOFF_MIN_NS 100000000ULL
+#define BACKOFF_MAX_NS 30000000000ULL
+
+// How long activity() has to stay the same to count as idle, which is also
+// the least time between two prestarts.
+#define IDLE_MS 500
+#define IDLE_NS (IDLE_MS * 1000000ULL)
+
+// Everything reaches the supervisor as a byte on its wake pipe, the tty of
+// a request or this for SIGCHLD.
+#define WAKE_CHILD 0xff
+
+struct session {
+    int slave;
+    bool keep_slave;
+    bool wanted;
+    bool prestarted;
+    pid_t pid;
+    uint64_t start_at;
+    uint64_t started_ns;
+    unsigned int failures;
+    char **envp;
+};
+
+// Sessions are added from other threads while the supervisor runs, so it
+// holds this for everything but waiting and calling back.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct session *sessions;
+static int session_count;
+static struct session_config config;
+static int wake_pipe[2] = {-1, -1};
+static sigset_t child_mask;
+
+static uint64_t started;
+static uint64_t exited;
+static uint64_t released;
+static uint64_t spawn_total_ns;
+static uint64_t spawn_max_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wake(uint8_t what) {
+    int saved_errno = errno;
+    if (write(wake_pipe[1], &what, 1) == -1) {
+        // Full, the supervisor has enough to wake up to already.
+    }
+    errno = saved_errno;
+}
+
+static void handle_child(int sig) {
+    (void)sig;
+    wake(WAKE_CHILD);
+}
+
+// The environment sessions get, ours with GCON_TTY set to their tty.
+static char **session_env(int tty) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char **envp = malloc((count + 2) * sizeof(char *));
+    char *tty_var = malloc(32);
+    if (envp == NULL || tty_var == NULL) {
+        free(envp);
+        free(tty_var);
+        return NULL;
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "GCON_TTY=", 9) != 0) {
+            envp[j++] = environ[i];
+        }
+    }
+    snprintf(tty_var, 32, "GCON_TTY=%d", tty);
+    envp[j++] = tty_var;
+    envp[j] = NULL;
+    return envp;
+}
+
+static bool set_flags(int fd, int cmd_get, int cmd_set, int flags) {
+    int old = fcntl(fd, cmd_get);
+    return old != -1 && fcntl(fd, cmd_set, old | flags) != -1;
+}
+
+bool session_init(int count, const struct session_config *session_config) {
+    sessions = calloc(count, sizeof(struct session));
+    if (sessions == NULL) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        sessions[i].slave = -1;
+        sessions[i].envp = session_env(i);
+        if (sessions[i].envp == NULL) {
+            return false;
+        }
+    }
+    session_count = count;
+    config = *session_config;
+
+    // Neither end may block, least of all the signal handler's.
+    if (pipe(wake_pipe) == -1) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!set_flags(wake_pipe[i], F_GETFL, F_SETFL, O_NONBLOCK) ||
+            !set_flags(wake_pipe[i], F_GETFD, F_SETFD, FD_CLOEXEC)) {
+            return false;
+        }
+    }
+
+    // Sessions start out with no signals blocked, whatever thread we are.
+    sigemptyset(&child_mask);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_child;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGCHLD, &sa, NULL) == 0;
+}
+
+void session_add(int tty, int slave, bool keep_slave) {
+    pthread_mutex_lock(&lock);
+    sessions[tty].slave = slave;
+    sessions[tty].keep_slave = keep_slave;
+    pthread_mutex_unlock(&lock);
+}
+
+void session_request(int tty) {
+    if (wake_pipe[1] != -1 && tty >= 0 && tty < session_count) {
+        wake(tty);
+    }
+}
+
+static uint64_t backoff_ns(unsigned int failures) {
+    if (failures == 0) {
+        return 0;
+    }
+    if (failures > 16) {
+        return BACKOFF_MAX_NS;
+    }
+    uint64_t wait = BACKOFF_MIN_NS << (failures - 1);
+    return wait < BACKOFF_MAX_NS ? wait : BACKOFF_MAX_NS;
+}
+
+static void spawn(struct session *s) {
+    uint64_t start = now_ns();
+
+    // vfork only stops this thread until the exec, and copies nothing. The
+    // child borrows our memory meanwhile, so it sticks to system calls, and
+    // none of our handlers may run in it. Signals stay blocked until it has
+    // put back the default for every one we catch.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pid_t pid = vfork();
+    if (pid == 0) {
+        static const char msg[] = "Could not start session\n";
+        struct sigaction dfl = {0};
+        dfl.sa_handler = SIG_DFL;
+        sigemptyset(&dfl.sa_mask);
+        for (int sig = 1; sig < NSIG; sig++) {
+            struct sigaction current;
+            if (sigaction(sig, NULL, &current) == 0 &&
+                current.sa_handler != SIG_DFL && current.sa_handler != SIG_IGN) {
+                sigaction(sig, &dfl, NULL);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+
+        // Only the leader of a session of its own can take the slave as its
+        // controlling terminal.
+        setsid();
+        dup2(s->slave, 0);
+        dup2(s->slave, 1);
+        dup2(s->slave, 2);
+        ioctl(s->slave, TIOCSCTTY, 0);
+        execve(config.args[0], config.args, s->envp);
+
+        // Returning would run on in our borrowed memory and stack.
+        if (write(2, msg, sizeof(msg) - 1) == -1) {
+            // Nowhere left to complain to.
+        }
+        _exit(127);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    uint64_t now = now_ns();
+    s->wanted = false;
+    if (pid == -1) {
+        perror("Could not start session");
+        s->failures++;
+        s->wanted = true;
+        s->start_at = now + backoff_ns(s->failures);
+        return;
+    }
+
+    s->pid = pid;
+    s->started_ns = now;
+    __atomic_add_fetch(&started, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&spawn_total_ns, now - start, __ATOMIC_RELAXED);
+    if (now - start > __atomic_load_n(&spawn_max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&spawn_max_ns, now - start, __ATOMIC_RELAXED);
+    }
+
+    // Without our copy of the slave, the master hangs up once the session
+    // is gone.
+    if (!s->keep_slave) {
+        close(s->slave);
+        s->slave = -1;
+    }
+}
+
+static void reap(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < session_count; i++) {
+            struct session *s = &sessions[i];
+            if (s->pid != pid) {
+                continue;
+            }
+            s->pid = 0;
+            s->failures = now - s->started_ns < SHORT_LIVED_NS ? s->failures + 1 : 0;
+            if (s->slave != -1 && config.releasable != NULL && config.releasable(i)) {
+                close(s->slave);
+                s->slave = -1;
+                __atomic_add_fetch(&released, 1, __ATOMIC_RELAXED);
+            } else if (config.respawn && s->slave != -1) {
+                s->wanted = true;
+                s->start_at = now + backoff_ns(s->failures);
+            }
+            __atomic_add_fetch(&exited, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void request(int tty, uint64_t now) {
+    struct session *s = &sessions[tty];
+    if (s->pid == 0 && s->slave != -1 && !s->wanted) {
+        s->wanted = true;
+        s->start_at = now;
+    }
+}
+
+// First tty that never had a session nor was prestarted, or -1.
+static int next_prestart(void) {
+    for (int i = 0; i < session_count; i++) {
+        struct session *s = &sessions[i];
+        if (!s->prestarted && s->pid == 0 && !s->wanted && s->started_ns == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static noreturn void *supervisor_thread(void *arg) {
+    (void)arg;
+    struct pollfd pfd = { .fd = wake_pipe[0], .events = POLLIN };
+    uint64_t last_activity = config.activity != NULL ? config.activity() : 0;
+    uint64_t quiet_since = now_ns();
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        uint64_t now = now_ns();
+        int timeout = -1;
+        for (int i = 0; i < session_count; i++) {
+            struct session *s = &sessions[i];
+            if (s->wanted && s->pid == 0) {
+                int wait_ms = s->start_at > now ? (s->start_at - now + 999999) / 1000000 : 0;
+                if (timeout == -1 || wait_ms < timeout) {
+                    timeout = wait_ms;
+                }
+            }
+        }
+        if (config.prestart && next_prestart() != -1 && (timeout == -1 || timeout > IDLE_MS)) {
+            timeout = IDLE_MS;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+            perror("Could not poll sessions");
+        }
+
+        pthread_mutex_lock(&lock);
+        uint8_t wakes[64];
+        ssize_t count;
+        while ((count = read(wake_pipe[0], wakes, sizeof(wakes))) > 0) {
+            for (ssize_t i = 0; i < count; i++) {
+                if (wakes[i] != WAKE_CHILD && wakes[i] < session_count) {
+                    request(wakes[i], now_ns());
+                }
+            }
+        }
+        reap();
+
+        now = now_ns();
+        if (config.prestart) {
+            uint64_t current = config.activity != NULL ? config.activity() : 0;
+            if (current != last_activity) {
+                last_activity = current;
+                quiet_since = now;
+            } else if (now - quiet_since >= IDLE_NS) {
+                int tty = next_prestart();
+                if (tty != -1) {
+                    // Adding a tty takes the lock, so creating it cannot
+                    // be done with it held.
+                    sessions[tty].prestarted = true;
+                    bool ready = sessions[tty].slave != -1;
+                    if (!ready && config.create != NULL) {
+                        pthread_mutex_unlock(&lock);
+                        ready = config.create(tty);
+                        pthread_mutex_lock(&lock);
+                    }
+                    if (ready) {
+                        request(tty, now_ns());
+                    }
+                }
+                quiet_since = now_ns();
+            }
+        }
+
+        for (int i = 0; i < session_count; i++) {
+            struct session *s = &sessions[i];
+            if (s->wanted && s->pid == 0 && s->start_at <= now) {
+                spawn(s);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+bool session_start_supervisor(void) {
+    pthread_t thread;
+    return pthread_create(&thread, NULL, supervisor_thread, NULL) == 0;
+}
+
+void session_dump_stats(FILE *out) {
+    fprintf(out, "session.started %llu\n",
+        (unsigned long long)__atomic_load_n(&started, __ATOMIC_RELAXED));
+    fprintf(out, "session.exited %llu\n",
+        (unsigned long long)__atomic_load_n(&exited, __ATOMIC_RELAXED));
+    fprintf(out, "session.released %llu\n",
+        (unsigned long long)__atomic_load_n(&released, __ATOMIC_RELAXED));
+    fprintf(out, "session.spawn_total_ns %llu\n",
+        (unsigned long long)__atomic_load_n(&spawn_total_ns, __ATOMIC_RELAXED));
+    fprintf(out, "session.spawn_max_ns %llu\n",
+        (unsigned long long)__atomic_load_n(&spawn_max_ns, __ATOMIC_RELAXED));
+}
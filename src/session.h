@@ -0,0 +1,62 @@
+/*
+    session.h: Supervisor of the sessions running on each tty
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct session_config {
+    // args[0] has to be an absolute path.
+    char *const *args;
+    // Start sessions again when they exit, waiting longer each time one
+    // exits soon after starting.
+    bool respawn;
+    // Give ttys nobody switched to yet their session once activity() stops
+    // changing, so switching to them finds it ready. create() is called
+    // first for ttys that were never added, and has to add them.
+    bool prestart;
+    uint64_t (*activity)(void);
+    bool (*create)(int tty);
+    // Whether a tty whose session exited may be let go of instead, if not
+    // NULL. Our copy of its slave is closed then, so its master hangs up,
+    // and it gets no session again until it is added anew.
+    bool (*releasable)(int tty);
+};
+
+// Sessions are started, reaped and restarted by a thread of their own, so
+// none of it happens under a tty or framebuffer lock.
+bool session_init(int count, const struct session_config *config);
+
+// Run sessions of tty on slave, from now on. Without keep_slave our copy of
+// it is closed once the session starts, so the master hangs up when it
+// exits, and it is never started again. Safe from any thread.
+void session_add(int tty, int slave, bool keep_slave);
+
+// Start the supervisor thread, with the signals the caller blocks blocked.
+bool session_start_supervisor(void);
+
+// Ask for tty to have a session, if it has none. Safe from any thread and
+// before the supervisor runs.
+void session_request(int tty);
+
+void session_dump_stats(FILE *out);
+
+#endif
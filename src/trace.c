@@ -0,0 +1,266 @@
+/*
+    trace.c: Input to display latency tracing
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <trace.h>
+
+#ifdef GCON_TRACE
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE 16384
+
+struct trace_event {
+    uint64_t ts;
+    uint64_t dur;
+    int8_t tty;
+    uint8_t point;
+    bool span;
+};
+
+// Rings are never freed, as dumping may be walking them. Those of threads
+// that exited are taken over by new ones instead, so tids in the trace
+// stand for a ring rather than a single thread.
+struct trace_ring {
+    struct trace_ring *next;
+    int tid;
+    bool in_use;
+    uint64_t head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+// Log-linear buckets, 4 per power of two, so percentiles are within 25%.
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+};
+
+static const char *const point_names[TRACE_POINT_COUNT] = {
+    [TRACE_KBD_READ]         = "kbd_read",
+    [TRACE_PTY_WRITE]        = "pty_write",
+    [TRACE_MASTER_READ]      = "master_read",
+    [TRACE_TERM_WRITE]       = "term_write",
+    [TRACE_FLUSH]            = "flush",
+    [TRACE_INPUT_TO_DISPLAY] = "input_to_display"
+};
+
+static struct trace_ring *rings = NULL;
+static int ring_count = 0;
+static __thread struct trace_ring *local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static bool ring_key_made = false;
+static struct histogram histograms[TRACE_POINT_COUNT];
+
+// Start of the oldest input not yet written to the foreground, and of the
+// oldest one written but not yet drawn.
+static uint64_t input_ns = 0;
+static uint64_t output_ns = 0;
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_ring(void *ring) {
+    __atomic_store_n(&((struct trace_ring *)ring)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key(void) {
+    ring_key_made = pthread_key_create(&ring_key, release_ring) == 0;
+}
+
+static struct trace_ring *get_ring(void) {
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+
+    // Without the key rings cannot be given back, and are only added.
+    pthread_once(&ring_key_once, make_ring_key);
+    struct trace_ring *ring = NULL;
+    if (ring_key_made) {
+        for (struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+            bool in_use = false;
+            if (__atomic_compare_exchange_n(&r->in_use, &in_use, true, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                ring = r;
+                break;
+            }
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->tid = __atomic_add_fetch(&ring_count, 1, __ATOMIC_RELAXED);
+        ring->in_use = true;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    if (ring_key_made) {
+        pthread_setspecific(ring_key, ring);
+    }
+    local_ring = ring;
+    return ring;
+}
+
+static size_t hist_bucket(uint64_t value) {
+    if (value < (1 << HIST_SUB_BITS)) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((size_t)(msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that falls in a bucket.
+static uint64_t hist_bucket_max(size_t bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    uint64_t step = (uint64_t)1 << (msb - HIST_SUB_BITS);
+    return ((uint64_t)1 << msb) + (sub + 1) * step - 1;
+}
+
+static void hist_add(struct histogram *hist, uint64_t value) {
+    __atomic_add_fetch(&hist->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t hist_percentile(struct histogram *hist, unsigned int pct) {
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t target = (count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            return hist_bucket_max(i);
+        }
+    }
+    return UINT64_MAX;
+}
+
+static void record(enum trace_point point, int tty, uint64_t ts, uint64_t dur, bool span) {
+    struct trace_ring *ring = get_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    // Only this thread moves the head, the release publishes the event to
+    // whoever dumps the ring.
+    uint64_t head = ring->head;
+    struct trace_event *event = &ring->events[head % TRACE_RING_SIZE];
+    event->ts = ts;
+    event->dur = dur;
+    event->tty = tty;
+    event->point = point;
+    event->span = span;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_instant(enum trace_point point, int tty) {
+    record(point, tty, trace_now(), 0, false);
+}
+
+void trace_span(enum trace_point point, int tty, uint64_t start) {
+    uint64_t dur = trace_now() - start;
+    record(point, tty, start, dur, true);
+    hist_add(&histograms[point], dur);
+}
+
+void trace_input(void) {
+    uint64_t none = 0;
+    __atomic_compare_exchange_n(&input_ns, &none, trace_now(), false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void trace_output(void) {
+    uint64_t start = __atomic_exchange_n(&input_ns, 0, __ATOMIC_RELAXED);
+    uint64_t none = 0;
+    if (start != 0) {
+        __atomic_compare_exchange_n(&output_ns, &none, start, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+void trace_presented(void) {
+    uint64_t start = __atomic_exchange_n(&output_ns, 0, __ATOMIC_RELAXED);
+    if (start != 0) {
+        trace_span(TRACE_INPUT_TO_DISPLAY, -1, start);
+    }
+}
+
+void trace_dump_stats(FILE *out) {
+    for (int i = 0; i < TRACE_POINT_COUNT; i++) {
+        uint64_t count = __atomic_load_n(&histograms[i].count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "trace.%s.count %llu\n", point_names[i], (unsigned long long)count);
+        fprintf(out, "trace.%s.p50_ns %llu\n", point_names[i],
+            (unsigned long long)hist_percentile(&histograms[i], 50));
+        fprintf(out, "trace.%s.p99_ns %llu\n", point_names[i],
+            (unsigned long long)hist_percentile(&histograms[i], 99));
+    }
+}
+
+bool trace_dump_chrome(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (struct trace_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = tail; i < head; i++) {
+            struct trace_event *event = &ring->events[i % TRACE_RING_SIZE];
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"gcon\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,",
+                first ? "" : ",\n", point_names[event->point], ring->tid, event->ts / 1000.0);
+            if (event->span) {
+                fprintf(out, "\"ph\":\"X\",\"dur\":%.3f", event->dur / 1000.0);
+            } else {
+                fprintf(out, "\"ph\":\"i\",\"s\":\"t\"");
+            }
+            if (event->tty >= 0) {
+                fprintf(out, ",\"args\":{\"tty\":%d}", event->tty);
+            }
+            fputc('}', out);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    bool ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+    trace.h: Input to display latency tracing
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Points along the path a keypress takes to the screen.
+enum trace_point {
+    TRACE_KBD_READ,
+    TRACE_PTY_WRITE,
+    TRACE_MASTER_READ,
+    TRACE_TERM_WRITE,
+    TRACE_FLUSH,
+    TRACE_INPUT_TO_DISPLAY,
+    TRACE_POINT_COUNT
+};
+
+#ifdef GCON_TRACE
+
+// Events go to a ring owned by the calling thread, so recording them takes
+// no locks. Spans are timed from a start taken with TRACE_START.
+#define TRACE_START(var) uint64_t var = trace_now()
+#define TRACE_INSTANT(point, tty) trace_instant(point, tty)
+#define TRACE_SPAN(point, tty, start) trace_span(point, tty, start)
+
+// Input to display latency is measured from the keyboard read, through the
+// first write to the foreground terminal after it, to the flush that draws
+// that write. It shows up in the trace as a span of its own.
+#define TRACE_INPUT() trace_input()
+#define TRACE_OUTPUT() trace_output()
+#define TRACE_PRESENTED() trace_presented()
+
+#define TRACE_DUMP_STATS(out) trace_dump_stats(out)
+
+uint64_t trace_now(void);
+void trace_instant(enum trace_point point, int tty);
+void trace_span(enum trace_point point, int tty, uint64_t start);
+void trace_input(void);
+void trace_output(void);
+void trace_presented(void);
+
+// p50/p99 of every span and of the input to display latency, as stats lines.
+void trace_dump_stats(FILE *out);
+
+// Write what the rings hold in Chrome trace event format, which Perfetto
+// loads as well. Events recorded while dumping may be torn or missing.
+bool trace_dump_chrome(const char *path);
+
+#else
+
+#define TRACE_START(var) do {} while (0)
+#define TRACE_INSTANT(point, tty) do {} while (0)
+#define TRACE_SPAN(point, tty, start) do {} while (0)
+#define TRACE_INPUT() do {} while (0)
+#define TRACE_OUTPUT() do {} while (0)
+#define TRACE_PRESENTED() do {} while (0)
+#define TRACE_DUMP_STATS(out) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/*
+    mkkeymap.c: Compile text keymaps into gcon's flat table format
+    Copyright (C) 2025 streaksu
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Every non empty line not starting with '#' describes one key:
+//
+//     [e0] <scancode> <plain> [<shift> <capslock> <shift+capslock>] [cursor]
+//
+// A single value is used for all modifier states. Values are '-' for keys
+// that send nothing, a double quoted string with C style escapes (plus \e
+// for escape), or any other token taken literally. "cursor" marks keys that
+// send SS3 instead of CSI in application cursor mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <keymap.h>
+
+static struct keymap_entry table[KEYMAP_ENTRIES];
+
+static const char *input_path;
+static int line_number;
+
+static void fail(const char *msg) {
+    fprintf(stderr, "%s:%d: %s\n", input_path, line_number, msg);
+    exit(1);
+}
+
+// Split a line into tokens in place, keeping quoted strings whole with
+// their quotes, returns the number of tokens.
+static int tokenize(char *line, char **tokens, int max) {
+    int count = 0;
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0') {
+            return count;
+        }
+        if (count == max) {
+            fail("too many fields");
+        }
+
+        tokens[count++] = p;
+        if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') {
+                    fail("unterminated string");
+                }
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                }
+            }
+            p++;
+        } else {
+            while (*p != '\0' && !isspace((unsigned char)*p)) {
+                p++;
+            }
+        }
+
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+}
+
+static void parse_value(const char *token, struct keymap_entry *e) {
+    char bytes[64];
+    size_t len = 0;
+
+    if (strcmp(token, "-") == 0) {
+        e->len = 0;
+        return;
+    }
+
+    if (token[0] != '"') {
+        len = strlen(token);
+        if (len > sizeof(bytes)) {
+            fail("value too long");
+        }
+        memcpy(bytes, token, len);
+    } else {
+        for (const char *p = token + 1; *p != '"'; p++) {
+            char c = *p;
+            if (c == '\\') {
+                switch (*++p) {
+                    case 'e':  c = '\e'; break;
+                    case 'n':  c = '\n'; break;
+                    case 'r':  c = '\r'; break;
+                    case 't':  c = '\t'; break;
+                    case 'b':  c = '\b'; break;
+                    case 'x': {
+                        char hex[3] = {0};
+                        if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) {
+                            fail("bad \\x escape");
+                        }
+                        hex[0] = *++p;
+                        hex[1] = *++p;
+                        c = strtoul(hex, NULL, 16);
+                        break;
+                    }
+                    default: c = *p; break;
+                }
+            }
+            if (len == sizeof(bytes)) {
+                fail("value too long");
+            }
+            bytes[len++] = c;
+        }
+    }
+
+    if (len > sizeof(e->bytes)) {
+        fail("value longer than 6 bytes");
+    }
+    e->len = len;
+    memcpy(e->bytes, bytes, len);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <keymap.map> <keymap.kmap>\n", argv[0]);
+        return 1;
+    }
+
+    input_path = argv[1];
+    FILE *in = fopen(input_path, "r");
+    if (in == NULL) {
+        perror("Could not open keymap");
+        return 1;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line_number++;
+        if (line[0] == '#') {
+            continue;
+        }
+
+        char *tokens[8];
+        int count = tokenize(line, tokens, 8);
+        if (count == 0) {
+            continue;
+        }
+
+        int t = 0;
+        bool extended = false;
+        if (strcmp(tokens[t], "e0") == 0) {
+            extended = true;
+            t++;
+        }
+        if (t == count) {
+            fail("missing scancode");
+        }
+
+        char *end;
+        unsigned long scancode = strtoul(tokens[t++], &end, 0);
+        if (*end != '\0' || scancode >= KEYMAP_SCANCODES) {
+            fail("bad scancode");
+        }
+
+        uint8_t flags = 0;
+        if (count > t && strcmp(tokens[count - 1], "cursor") == 0) {
+            flags = KEYMAP_CURSOR;
+            count--;
+        }
+
+        int values = count - t;
+        if (values != 1 && values != KEYMAP_MOD_STATES) {
+            fail("expected 1 or 4 values");
+        }
+        for (unsigned mods = 0; mods < KEYMAP_MOD_STATES; mods++) {
+            struct keymap_entry *e = &table[keymap_index(mods, extended, scancode)];
+            parse_value(tokens[t + (values == 1 ? 0 : mods)], e);
+            e->flags = flags;
+        }
+    }
+    fclose(in);
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        perror("Could not create compiled keymap");
+        return 1;
+    }
+    if (fwrite(KEYMAP_MAGIC, KEYMAP_MAGIC_SIZE, 1, out) != 1
+     || fwrite(table, sizeof(table), 1, out) != 1
+     || fclose(out) != 0) {
+        perror("Could not write compiled keymap");
+        remove(argv[2]);
+        return 1;
+    }
+
+    return 0;
+}